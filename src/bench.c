@@ -0,0 +1,171 @@
+// Times what capture_create does to the client's buffer for a full-screen capture:
+// clearing the entire buffer and then copying the outputs over it (as it used to)
+// against clearing only the parts that no output covers (as it does now).
+//
+// This is a standalone model: it doesn't link the plugin, whose helpers are static and need
+// a running compositor, and doesn't call clear_uncovered_area(). Outputs are plain memory
+// and reading them is a memcpy() per row. Keep clear_uncovered() below in line with
+// clear_uncovered_area() in wakefield.c when that changes.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#define BENCH_ITERATIONS 200
+
+struct bench_output {
+    int32_t   x;
+    int32_t   y;
+    int32_t   width;
+    int32_t   height;
+    uint32_t *pixels;
+};
+
+struct bench_layout {
+    const char         *name;
+    int                 n_outputs;
+    struct bench_output outputs[2];
+};
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Copies the part of every output that the capture at (x, y) covers into the capture,
+ * just like capture_create does when the buffer has the compositor's format.
+ */
+static void
+copy_outputs(const struct bench_layout *layout, uint32_t *capture,
+             int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    for (int i = 0; i < layout->n_outputs; i++) {
+        const struct bench_output *output = &layout->outputs[i];
+        const int32_t x1 = x > output->x ? x : output->x;
+        const int32_t y1 = y > output->y ? y : output->y;
+        const int32_t x2 = x + width < output->x + output->width ? x + width : output->x + output->width;
+        const int32_t y2 = y + height < output->y + output->height ? y + height : output->y + output->height;
+        for (int32_t row = y1; row < y2; row++) {
+            memcpy(&capture[(size_t)(row - y)*width + (x1 - x)],
+                   &output->pixels[(size_t)(row - output->y)*output->width + (x1 - output->x)],
+                   (size_t)(x2 - x1) * sizeof(uint32_t));
+        }
+    }
+}
+
+static void
+clear_all(const struct bench_layout *layout, uint32_t *capture,
+          int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    memset(capture, 0, (size_t)width * height * sizeof(uint32_t));
+}
+
+/**
+ * Clears the capture rectangle minus the union of the output regions, like clear_uncovered_area().
+ */
+static void
+clear_uncovered(const struct bench_layout *layout, uint32_t *capture,
+                int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    pixman_region32_t uncovered;
+    pixman_region32_init_rect(&uncovered, x, y, width, height);
+    for (int i = 0; i < layout->n_outputs; i++) {
+        const struct bench_output *output = &layout->outputs[i];
+        pixman_region32_t output_region;
+        pixman_region32_init_rect(&output_region, output->x, output->y, output->width, output->height);
+        pixman_region32_subtract(&uncovered, &uncovered, &output_region);
+        pixman_region32_fini(&output_region);
+    }
+
+    int n_boxes;
+    const pixman_box32_t * const boxes = pixman_region32_rectangles(&uncovered, &n_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+        for (int32_t row = boxes[i].y1; row < boxes[i].y2; row++) {
+            memset(&capture[(size_t)(row - y)*width + (boxes[i].x1 - x)], 0,
+                   (size_t)(boxes[i].x2 - boxes[i].x1) * sizeof(uint32_t));
+        }
+    }
+
+    pixman_region32_fini(&uncovered);
+}
+
+typedef void (*clear_func_t)(const struct bench_layout *layout, uint32_t *capture,
+                             int32_t x, int32_t y, int32_t width, int32_t height);
+
+/**
+ * @return milliseconds per capture.
+ */
+static double
+run(const struct bench_layout *layout, clear_func_t clear, uint32_t *capture,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    // Warm up the caches and fault in the pages.
+    clear(layout, capture, x, y, width, height);
+    copy_outputs(layout, capture, x, y, width, height);
+
+    const double start = now_ms();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        clear(layout, capture, x, y, width, height);
+        copy_outputs(layout, capture, x, y, width, height);
+    }
+    return (now_ms() - start) / BENCH_ITERATIONS;
+}
+
+int
+main(void)
+{
+    struct bench_layout layouts[] = {
+        { .name = "single 1920x1080",    .n_outputs = 1,
+          .outputs = { { 0, 0, 1920, 1080 } } },
+        { .name = "dual 2x 1920x1080",   .n_outputs = 2,
+          .outputs = { { 0, 0, 1920, 1080 }, { 1920, 0, 1920, 1080 } } },
+    };
+
+    printf("%-20s %12s %14s %10s\n", "layout", "clear all", "clear uncovered", "saved");
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        struct bench_layout *layout = &layouts[l];
+
+        // A full-screen capture covers the extents of all the outputs.
+        int32_t width  = 0;
+        int32_t height = 0;
+        for (int i = 0; i < layout->n_outputs; i++) {
+            struct bench_output *output = &layout->outputs[i];
+            output->pixels = malloc((size_t)output->width * output->height * sizeof(uint32_t));
+            if (output->pixels == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            memset(output->pixels, 0x5a, (size_t)output->width * output->height * sizeof(uint32_t));
+            if (output->x + output->width > width)
+                width = output->x + output->width;
+            if (output->y + output->height > height)
+                height = output->y + output->height;
+        }
+
+        uint32_t *capture = malloc((size_t)width * height * sizeof(uint32_t));
+        if (capture == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        const double all       = run(layout, clear_all, capture, 0, 0, width, height);
+        const double uncovered = run(layout, clear_uncovered, capture, 0, 0, width, height);
+        printf("%-20s %9.3f ms %12.3f ms %9.1f%%\n",
+               layout->name, all, uncovered, 100.0 * (all - uncovered) / all);
+
+        free(capture);
+        for (int i = 0; i < layout->n_outputs; i++) {
+            free(layout->outputs[i].pixels);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include <stdbool.h>
+
+#include "compare.h"
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WAKEFIELD_X86 1
+#include <immintrin.h>
+#endif
+
+static inline bool
+pixels_match(uint32_t a, uint32_t b, uint8_t tolerance)
+{
+    for (int shift = 0; shift < 24; shift += 8) {
+        const int32_t diff = (int32_t)((a >> shift) & 0xffu) - (int32_t)((b >> shift) & 0xffu);
+        if (diff > tolerance || -diff > tolerance) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Compares pixels from the given index to the end of the row, adding the mismatches
+ * to the given count of those found earlier in the row; returns the new count.
+ */
+static inline int32_t
+compare_row_tail(const uint32_t *a, const uint32_t *b, int32_t from, int32_t width,
+                 uint8_t tolerance, uint32_t *mask, int32_t count, int32_t *first, int32_t *last)
+{
+    for (int32_t x = from; x < width; x++) {
+        const bool match = pixels_match(a[x], b[x], tolerance);
+        if (mask) {
+            mask[x] = match ? 0 : 0xffffffffu;
+        }
+        if (!match) {
+            if (count == 0) {
+                *first = x;
+            }
+            *last = x;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static int32_t
+compare_row_scalar(const uint32_t *a, const uint32_t *b, int32_t width,
+                   uint8_t tolerance, uint32_t *mask, int32_t *first, int32_t *last)
+{
+    return compare_row_tail(a, b, 0, width, tolerance, mask, 0, first, last);
+}
+
+static inline void
+histogram_row(const uint32_t *row, int32_t width, uint32_t *histogram)
+{
+    for (int32_t x = 0; x < width; x++) {
+        const uint32_t p = row[x];
+        histogram[((p >> 18) & 0x30u) | ((p >> 12) & 0x0cu) | ((p >> 6) & 0x03u)]++;
+    }
+}
+
+/**
+ * Returns the per-channel minimum of the given pixels as r8g8b8.
+ */
+static inline uint32_t
+channel_min(uint32_t a, uint32_t b)
+{
+    uint32_t min = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        const uint32_t ca = (a >> shift) & 0xffu;
+        const uint32_t cb = (b >> shift) & 0xffu;
+        min |= (ca < cb ? ca : cb) << shift;
+    }
+
+    return min;
+}
+
+/**
+ * Returns the per-channel maximum of the given pixels as r8g8b8.
+ */
+static inline uint32_t
+channel_max(uint32_t a, uint32_t b)
+{
+    uint32_t max = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        const uint32_t ca = (a >> shift) & 0xffu;
+        const uint32_t cb = (b >> shift) & 0xffu;
+        max |= (ca > cb ? ca : cb) << shift;
+    }
+
+    return max;
+}
+
+static inline void
+stats_row_tail(const uint32_t *row, int32_t from, int32_t width, uint32_t rgb, uint8_t tolerance,
+               struct wakefield_stats *stats)
+{
+    for (int32_t x = from; x < width; x++) {
+        const uint32_t p = row[x];
+        stats->sum[0] += p & 0xffu;
+        stats->sum[1] += (p >> 8) & 0xffu;
+        stats->sum[2] += (p >> 16) & 0xffu;
+        stats->min = channel_min(stats->min, p);
+        stats->max = channel_max(stats->max, p);
+        if (!pixels_match(p, rgb, tolerance)) {
+            stats->differing++;
+        }
+    }
+}
+
+/**
+ * Folds the per-lane minimums and maximums of a vector kernel into the given statistics.
+ */
+static inline void
+fold_lanes(const uint32_t *lanes_min, const uint32_t *lanes_max, int n_lanes, struct wakefield_stats *stats)
+{
+    for (int i = 0; i < n_lanes; i++) {
+        stats->min = channel_min(stats->min, lanes_min[i]);
+        stats->max = channel_max(stats->max, lanes_max[i]);
+    }
+}
+
+static void
+stats_row_scalar(const uint32_t *row, int32_t width, uint32_t rgb, uint8_t tolerance,
+                 struct wakefield_stats *stats)
+{
+    stats_row_tail(row, 0, width, rgb, tolerance, stats);
+    histogram_row(row, width, stats->histogram);
+}
+
+#ifdef WAKEFIELD_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * The vector kernels compute the per-channel absolute difference with saturating
+ * subtraction both ways and then subtract the tolerance, again with saturation;
+ * a pixel mismatches iff anything is left. The tolerance of the alpha channel is 0xff,
+ * so it never counts.
+ */
+
+static inline int32_t
+count_mismatch_bits(int bits, int32_t x, int32_t count, int32_t *first, int32_t *last)
+{
+    if (bits) {
+        if (count == 0) {
+            *first = x + __builtin_ctz(bits);
+        }
+        *last = x + 31 - __builtin_clz(bits);
+        count += __builtin_popcount(bits);
+    }
+
+    return count;
+}
+
+static SSE2 int32_t
+compare_row_sse2(const uint32_t *a, const uint32_t *b, int32_t width,
+                 uint8_t tolerance, uint32_t *mask, int32_t *first, int32_t *last)
+{
+    const __m128i tol  = _mm_set1_epi32((int)(0xff000000u | tolerance * 0x010101u));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(-1);
+
+    int32_t count = 0;
+    int32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i va   = _mm_loadu_si128((const __m128i *)&a[x]);
+        const __m128i vb   = _mm_loadu_si128((const __m128i *)&b[x]);
+        const __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        const __m128i bad  = _mm_xor_si128(_mm_cmpeq_epi32(_mm_subs_epu8(diff, tol), zero), ones);
+        if (mask) {
+            _mm_storeu_si128((__m128i *)&mask[x], bad);
+        }
+        count = count_mismatch_bits(_mm_movemask_ps(_mm_castsi128_ps(bad)), x, count, first, last);
+    }
+
+    return compare_row_tail(a, b, x, width, tolerance, mask, count, first, last);
+}
+
+static AVX2 int32_t
+compare_row_avx2(const uint32_t *a, const uint32_t *b, int32_t width,
+                 uint8_t tolerance, uint32_t *mask, int32_t *first, int32_t *last)
+{
+    const __m256i tol  = _mm256_set1_epi32((int)(0xff000000u | tolerance * 0x010101u));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+
+    int32_t count = 0;
+    int32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i va   = _mm256_loadu_si256((const __m256i *)&a[x]);
+        const __m256i vb   = _mm256_loadu_si256((const __m256i *)&b[x]);
+        const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        const __m256i bad  = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_subs_epu8(diff, tol), zero), ones);
+        if (mask) {
+            _mm256_storeu_si256((__m256i *)&mask[x], bad);
+        }
+        count = count_mismatch_bits(_mm256_movemask_ps(_mm256_castsi256_ps(bad)), x, count, first, last);
+    }
+
+    return compare_row_tail(a, b, x, width, tolerance, mask, count, first, last);
+}
+
+/*
+ * The statistics kernels keep the per-channel minimum and maximum of every lane
+ * with byte-wise min/max and sum each channel with _mm_sad_epu8() of the pixels
+ * masked to that channel, which adds up the bytes into 64-bit halves.
+ * The histogram has no efficient vector form and is always built by the scalar loop.
+ */
+
+static SSE2 void
+stats_row_sse2(const uint32_t *row, int32_t width, uint32_t rgb, uint8_t tolerance,
+               struct wakefield_stats *stats)
+{
+    const __m128i tol   = _mm_set1_epi32((int)(0xff000000u | tolerance * 0x010101u));
+    const __m128i color = _mm_set1_epi32((int)rgb);
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i b     = _mm_set1_epi32(0x000000ff);
+    const __m128i g     = _mm_set1_epi32(0x0000ff00);
+    const __m128i r     = _mm_set1_epi32(0x00ff0000);
+
+    __m128i min   = _mm_set1_epi32((int)stats->min);
+    __m128i max   = _mm_set1_epi32((int)stats->max);
+    __m128i sum_b = zero;
+    __m128i sum_g = zero;
+    __m128i sum_r = zero;
+    int32_t same  = 0;
+
+    int32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)&row[x]);
+        min   = _mm_min_epu8(min, v);
+        max   = _mm_max_epu8(max, v);
+        sum_b = _mm_add_epi64(sum_b, _mm_sad_epu8(_mm_and_si128(v, b), zero));
+        sum_g = _mm_add_epi64(sum_g, _mm_sad_epu8(_mm_and_si128(v, g), zero));
+        sum_r = _mm_add_epi64(sum_r, _mm_sad_epu8(_mm_and_si128(v, r), zero));
+
+        const __m128i diff = _mm_or_si128(_mm_subs_epu8(v, color), _mm_subs_epu8(color, v));
+        const __m128i ok   = _mm_cmpeq_epi32(_mm_subs_epu8(diff, tol), zero);
+        same += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(ok)));
+    }
+
+    uint32_t lanes_min[4], lanes_max[4];
+    uint64_t sums[3][2];
+    _mm_storeu_si128((__m128i *)lanes_min, min);
+    _mm_storeu_si128((__m128i *)lanes_max, max);
+    _mm_storeu_si128((__m128i *)sums[0], sum_b);
+    _mm_storeu_si128((__m128i *)sums[1], sum_g);
+    _mm_storeu_si128((__m128i *)sums[2], sum_r);
+
+    fold_lanes(lanes_min, lanes_max, 4, stats);
+    stats->sum[0] += sums[0][0] + sums[0][1];
+    stats->sum[1] += sums[1][0] + sums[1][1];
+    stats->sum[2] += sums[2][0] + sums[2][1];
+    stats->differing += x - same;
+
+    stats_row_tail(row, x, width, rgb, tolerance, stats);
+    histogram_row(row, width, stats->histogram);
+}
+
+static AVX2 void
+stats_row_avx2(const uint32_t *row, int32_t width, uint32_t rgb, uint8_t tolerance,
+               struct wakefield_stats *stats)
+{
+    const __m256i tol   = _mm256_set1_epi32((int)(0xff000000u | tolerance * 0x010101u));
+    const __m256i color = _mm256_set1_epi32((int)rgb);
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i b     = _mm256_set1_epi32(0x000000ff);
+    const __m256i g     = _mm256_set1_epi32(0x0000ff00);
+    const __m256i r     = _mm256_set1_epi32(0x00ff0000);
+
+    __m256i min   = _mm256_set1_epi32((int)stats->min);
+    __m256i max   = _mm256_set1_epi32((int)stats->max);
+    __m256i sum_b = zero;
+    __m256i sum_g = zero;
+    __m256i sum_r = zero;
+    int32_t same  = 0;
+
+    int32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)&row[x]);
+        min   = _mm256_min_epu8(min, v);
+        max   = _mm256_max_epu8(max, v);
+        sum_b = _mm256_add_epi64(sum_b, _mm256_sad_epu8(_mm256_and_si256(v, b), zero));
+        sum_g = _mm256_add_epi64(sum_g, _mm256_sad_epu8(_mm256_and_si256(v, g), zero));
+        sum_r = _mm256_add_epi64(sum_r, _mm256_sad_epu8(_mm256_and_si256(v, r), zero));
+
+        const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(v, color), _mm256_subs_epu8(color, v));
+        const __m256i ok   = _mm256_cmpeq_epi32(_mm256_subs_epu8(diff, tol), zero);
+        same += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(ok)));
+    }
+
+    uint32_t lanes_min[8], lanes_max[8];
+    uint64_t sums[3][4];
+    _mm256_storeu_si256((__m256i *)lanes_min, min);
+    _mm256_storeu_si256((__m256i *)lanes_max, max);
+    _mm256_storeu_si256((__m256i *)sums[0], sum_b);
+    _mm256_storeu_si256((__m256i *)sums[1], sum_g);
+    _mm256_storeu_si256((__m256i *)sums[2], sum_r);
+
+    fold_lanes(lanes_min, lanes_max, 8, stats);
+    stats->sum[0] += sums[0][0] + sums[0][1] + sums[0][2] + sums[0][3];
+    stats->sum[1] += sums[1][0] + sums[1][1] + sums[1][2] + sums[1][3];
+    stats->sum[2] += sums[2][0] + sums[2][1] + sums[2][2] + sums[2][3];
+    stats->differing += x - same;
+
+    stats_row_tail(row, x, width, rgb, tolerance, stats);
+    histogram_row(row, width, stats->histogram);
+}
+
+#endif // WAKEFIELD_X86
+
+static const wakefield_compare_row_func_t compare_row_kernels[WAKEFIELD_ISA_COUNT] = {
+#ifdef WAKEFIELD_X86
+        compare_row_scalar, compare_row_sse2, compare_row_avx2
+#else
+        compare_row_scalar
+#endif
+};
+
+wakefield_compare_row_func_t
+wakefield_get_compare_row_func(void)
+{
+    return compare_row_kernels[wakefield_get_isa()];
+}
+
+static const wakefield_stats_row_func_t stats_row_kernels[WAKEFIELD_ISA_COUNT] = {
+#ifdef WAKEFIELD_X86
+        stats_row_scalar, stats_row_sse2, stats_row_avx2
+#else
+        stats_row_scalar
+#endif
+};
+
+wakefield_stats_row_func_t
+wakefield_get_stats_row_func(void)
+{
+    return stats_row_kernels[wakefield_get_isa()];
+}
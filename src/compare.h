@@ -0,0 +1,53 @@
+#ifndef WAKEFIELD_COMPARE_H
+#define WAKEFIELD_COMPARE_H
+
+#include <stdint.h>
+
+/**
+ * Compares two rows of width 32-bit pixels with 8-bit color channels ignoring the top
+ * (alpha) byte. A pixel mismatches if any of its color channels differs by more than tolerance.
+ *
+ * @param mask  (OUT, optional) receives 0xffffffff for every mismatched pixel and 0 for the rest
+ * @param first (OUT) the index of the first mismatched pixel; untouched if there are none
+ * @param last  (OUT) the index of the last mismatched pixel; untouched if there are none
+ * @return the number of mismatched pixels.
+ */
+typedef int32_t (*wakefield_compare_row_func_t)(const uint32_t *a, const uint32_t *b, int32_t width,
+                                                uint8_t tolerance, uint32_t *mask,
+                                                int32_t *first, int32_t *last);
+
+/**
+ * Returns the fastest implementation of the row comparison that the CPU supports.
+ */
+wakefield_compare_row_func_t
+wakefield_get_compare_row_func(void);
+
+/**
+ * Statistics of 32-bit pixels with 8-bit color channels; alpha is ignored.
+ * Channels are indexed by their position in the pixel: 0 is blue, 1 is green, 2 is red.
+ */
+struct wakefield_stats {
+    uint64_t sum[3];
+    uint32_t min;              // per-channel minimum, r8g8b8
+    uint32_t max;              // per-channel maximum, r8g8b8
+    uint64_t differing;        // the number of pixels that differ from the given color
+    uint32_t histogram[64];    // bin index is (r >> 6) << 4 | (g >> 6) << 2 | (b >> 6)
+};
+
+#define WAKEFIELD_STATS_INITIALIZER { .min = 0x00ffffffu }
+
+/**
+ * Adds a row of width pixels to the given statistics. A pixel differs from the given
+ * r8g8b8 color if any of its color channels differs by more than tolerance.
+ */
+typedef void (*wakefield_stats_row_func_t)(const uint32_t *row, int32_t width,
+                                           uint32_t rgb, uint8_t tolerance,
+                                           struct wakefield_stats *stats);
+
+/**
+ * Returns the fastest implementation of the row statistics that the CPU supports.
+ */
+wakefield_stats_row_func_t
+wakefield_get_stats_row_func(void);
+
+#endif //WAKEFIELD_COMPARE_H
@@ -0,0 +1,484 @@
+#include <wayland-server.h>
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WAKEFIELD_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * All the row kernels take 32-bit source pixels in either a8r8g8b8 ("argb") or a8b8g8r8
+ * ("abgr") order; the latter is handled by swapping the red and blue channels first.
+ * Every kernel has a scalar version that also processes the tail of the row
+ * that is too short for the vector versions.
+ */
+
+static inline uint32_t
+swap_rb(uint32_t p)
+{
+    return (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+}
+
+static inline uint16_t
+argb_to_rgb565(uint32_t p)
+{
+    return ((p >> 8) & 0xf800u) | ((p >> 5) & 0x07e0u) | ((p >> 3) & 0x001fu);
+}
+
+static inline uint32_t
+argb_to_xrgb2101010(uint32_t p)
+{
+    const uint32_t r = (p >> 16) & 0xffu;
+    const uint32_t g = (p >> 8) & 0xffu;
+    const uint32_t b = p & 0xffu;
+
+    // Replicate the top bits into the new low bits so that 0xff maps to 0x3ff.
+    return 0xc0000000u
+           | (((r << 2) | (r >> 6)) << 20)
+           | (((g << 2) | (g >> 6)) << 10)
+           | ((b << 2) | (b >> 6));
+}
+
+static void
+copy_row_scalar(void *dst, const void *src, int32_t width)
+{
+    memcpy(dst, src, (size_t)width * 4);
+}
+
+static inline void
+swap_rb_row_tail(uint32_t *dst, const uint32_t *src, int32_t from, int32_t width)
+{
+    for (int32_t x = from; x < width; x++) {
+        dst[x] = swap_rb(src[x]);
+    }
+}
+
+static inline void
+rgb565_row_tail(uint16_t *dst, const uint32_t *src, int32_t from, int32_t width, bool swap)
+{
+    for (int32_t x = from; x < width; x++) {
+        dst[x] = argb_to_rgb565(swap ? swap_rb(src[x]) : src[x]);
+    }
+}
+
+static inline void
+xrgb2101010_row_tail(uint32_t *dst, const uint32_t *src, int32_t from, int32_t width, bool swap)
+{
+    for (int32_t x = from; x < width; x++) {
+        dst[x] = argb_to_xrgb2101010(swap ? swap_rb(src[x]) : src[x]);
+    }
+}
+
+static void
+swap_rb_row_scalar(void *dst, const void *src, int32_t width)
+{
+    swap_rb_row_tail(dst, src, 0, width);
+}
+
+static void
+argb_to_rgb565_row_scalar(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_tail(dst, src, 0, width, false);
+}
+
+static void
+abgr_to_rgb565_row_scalar(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_tail(dst, src, 0, width, true);
+}
+
+static void
+argb_to_xrgb2101010_row_scalar(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_tail(dst, src, 0, width, false);
+}
+
+static void
+abgr_to_xrgb2101010_row_scalar(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_tail(dst, src, 0, width, true);
+}
+
+#ifdef WAKEFIELD_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+static inline SSE2 __m128i
+swap_rb_sse2(__m128i v)
+{
+    const __m128i ag = _mm_set1_epi32((int)0xff00ff00u);
+    const __m128i lo = _mm_set1_epi32(0xff);
+    return _mm_or_si128(_mm_and_si128(v, ag),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo),
+                                     _mm_slli_epi32(_mm_and_si128(v, lo), 16)));
+}
+
+/**
+ * Computes rgb565 in the low halves of the 32-bit lanes, sign-extended
+ * so that the signed saturation of _mm_packs_epi32() keeps the bits intact.
+ */
+static inline SSE2 __m128i
+rgb565_lanes_sse2(__m128i v)
+{
+    const __m128i r = _mm_and_si128(_mm_srli_epi32(v, 8), _mm_set1_epi32(0xf800));
+    const __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), _mm_set1_epi32(0x07e0));
+    const __m128i b = _mm_and_si128(_mm_srli_epi32(v, 3), _mm_set1_epi32(0x001f));
+    const __m128i x = _mm_or_si128(r, _mm_or_si128(g, b));
+    return _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+}
+
+static inline SSE2 __m128i
+expand_8_to_10_sse2(__m128i c)
+{
+    return _mm_or_si128(_mm_slli_epi32(c, 2), _mm_srli_epi32(c, 6));
+}
+
+static inline SSE2 __m128i
+xrgb2101010_sse2(__m128i v)
+{
+    const __m128i lo = _mm_set1_epi32(0xff);
+    const __m128i r  = expand_8_to_10_sse2(_mm_and_si128(_mm_srli_epi32(v, 16), lo));
+    const __m128i g  = expand_8_to_10_sse2(_mm_and_si128(_mm_srli_epi32(v, 8), lo));
+    const __m128i b  = expand_8_to_10_sse2(_mm_and_si128(v, lo));
+    return _mm_or_si128(_mm_set1_epi32((int)0xc0000000u),
+                        _mm_or_si128(_mm_slli_epi32(r, 20),
+                                     _mm_or_si128(_mm_slli_epi32(g, 10), b)));
+}
+
+static SSE2 void
+swap_rb_row_sse2(void *dst, const void *src, int32_t width)
+{
+    uint32_t *d = dst;
+    const uint32_t *s = src;
+    int32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)&s[x]);
+        _mm_storeu_si128((__m128i *)&d[x], swap_rb_sse2(v));
+    }
+    swap_rb_row_tail(d, s, x, width);
+}
+
+static inline SSE2 void
+rgb565_row_sse2(uint16_t *d, const uint32_t *s, int32_t width, bool swap)
+{
+    int32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)&s[x]);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)&s[x + 4]);
+        if (swap) {
+            v0 = swap_rb_sse2(v0);
+            v1 = swap_rb_sse2(v1);
+        }
+        _mm_storeu_si128((__m128i *)&d[x], _mm_packs_epi32(rgb565_lanes_sse2(v0), rgb565_lanes_sse2(v1)));
+    }
+    rgb565_row_tail(d, s, x, width, swap);
+}
+
+static SSE2 void
+argb_to_rgb565_row_sse2(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_sse2(dst, src, width, false);
+}
+
+static SSE2 void
+abgr_to_rgb565_row_sse2(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_sse2(dst, src, width, true);
+}
+
+static inline SSE2 void
+xrgb2101010_row_sse2(uint32_t *d, const uint32_t *s, int32_t width, bool swap)
+{
+    int32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[x]);
+        if (swap) {
+            v = swap_rb_sse2(v);
+        }
+        _mm_storeu_si128((__m128i *)&d[x], xrgb2101010_sse2(v));
+    }
+    xrgb2101010_row_tail(d, s, x, width, swap);
+}
+
+static SSE2 void
+argb_to_xrgb2101010_row_sse2(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_sse2(dst, src, width, false);
+}
+
+static SSE2 void
+abgr_to_xrgb2101010_row_sse2(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_sse2(dst, src, width, true);
+}
+
+static inline AVX2 __m256i
+swap_rb_avx2(__m256i v)
+{
+    const __m256i ag = _mm256_set1_epi32((int)0xff00ff00u);
+    const __m256i lo = _mm256_set1_epi32(0xff);
+    return _mm256_or_si256(_mm256_and_si256(v, ag),
+                           _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v, 16), lo),
+                                           _mm256_slli_epi32(_mm256_and_si256(v, lo), 16)));
+}
+
+static inline AVX2 __m256i
+rgb565_lanes_avx2(__m256i v)
+{
+    const __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 8), _mm256_set1_epi32(0xf800));
+    const __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5), _mm256_set1_epi32(0x07e0));
+    const __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 3), _mm256_set1_epi32(0x001f));
+    const __m256i x = _mm256_or_si256(r, _mm256_or_si256(g, b));
+    return _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+}
+
+static inline AVX2 __m256i
+expand_8_to_10_avx2(__m256i c)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(c, 2), _mm256_srli_epi32(c, 6));
+}
+
+static inline AVX2 __m256i
+xrgb2101010_avx2(__m256i v)
+{
+    const __m256i lo = _mm256_set1_epi32(0xff);
+    const __m256i r  = expand_8_to_10_avx2(_mm256_and_si256(_mm256_srli_epi32(v, 16), lo));
+    const __m256i g  = expand_8_to_10_avx2(_mm256_and_si256(_mm256_srli_epi32(v, 8), lo));
+    const __m256i b  = expand_8_to_10_avx2(_mm256_and_si256(v, lo));
+    return _mm256_or_si256(_mm256_set1_epi32((int)0xc0000000u),
+                           _mm256_or_si256(_mm256_slli_epi32(r, 20),
+                                           _mm256_or_si256(_mm256_slli_epi32(g, 10), b)));
+}
+
+static AVX2 void
+swap_rb_row_avx2(void *dst, const void *src, int32_t width)
+{
+    uint32_t *d = dst;
+    const uint32_t *s = src;
+    int32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)&s[x]);
+        _mm256_storeu_si256((__m256i *)&d[x], swap_rb_avx2(v));
+    }
+    swap_rb_row_tail(d, s, x, width);
+}
+
+static inline AVX2 void
+rgb565_row_avx2(uint16_t *d, const uint32_t *s, int32_t width, bool swap)
+{
+    int32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&s[x]);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)&s[x + 8]);
+        if (swap) {
+            v0 = swap_rb_avx2(v0);
+            v1 = swap_rb_avx2(v1);
+        }
+        // Packing works within 128-bit lanes, so restore the order of the 64-bit quarters afterwards.
+        const __m256i packed = _mm256_packs_epi32(rgb565_lanes_avx2(v0), rgb565_lanes_avx2(v1));
+        _mm256_storeu_si256((__m256i *)&d[x], _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    rgb565_row_tail(d, s, x, width, swap);
+}
+
+static AVX2 void
+argb_to_rgb565_row_avx2(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_avx2(dst, src, width, false);
+}
+
+static AVX2 void
+abgr_to_rgb565_row_avx2(void *dst, const void *src, int32_t width)
+{
+    rgb565_row_avx2(dst, src, width, true);
+}
+
+static inline AVX2 void
+xrgb2101010_row_avx2(uint32_t *d, const uint32_t *s, int32_t width, bool swap)
+{
+    int32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&s[x]);
+        if (swap) {
+            v = swap_rb_avx2(v);
+        }
+        _mm256_storeu_si256((__m256i *)&d[x], xrgb2101010_avx2(v));
+    }
+    xrgb2101010_row_tail(d, s, x, width, swap);
+}
+
+static AVX2 void
+argb_to_xrgb2101010_row_avx2(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_avx2(dst, src, width, false);
+}
+
+static AVX2 void
+abgr_to_xrgb2101010_row_avx2(void *dst, const void *src, int32_t width)
+{
+    xrgb2101010_row_avx2(dst, src, width, true);
+}
+
+#endif // WAKEFIELD_X86
+
+enum kernel {
+    KERNEL_SWAP_RB,
+    KERNEL_ARGB_TO_RGB565,
+    KERNEL_ABGR_TO_RGB565,
+    KERNEL_ARGB_TO_XRGB2101010,
+    KERNEL_ABGR_TO_XRGB2101010,
+    KERNEL_COUNT
+};
+
+static const wakefield_convert_row_func_t kernels[KERNEL_COUNT][WAKEFIELD_ISA_COUNT] = {
+#ifdef WAKEFIELD_X86
+        [KERNEL_SWAP_RB]             = { swap_rb_row_scalar, swap_rb_row_sse2, swap_rb_row_avx2 },
+        [KERNEL_ARGB_TO_RGB565]      = { argb_to_rgb565_row_scalar, argb_to_rgb565_row_sse2, argb_to_rgb565_row_avx2 },
+        [KERNEL_ABGR_TO_RGB565]      = { abgr_to_rgb565_row_scalar, abgr_to_rgb565_row_sse2, abgr_to_rgb565_row_avx2 },
+        [KERNEL_ARGB_TO_XRGB2101010] = { argb_to_xrgb2101010_row_scalar, argb_to_xrgb2101010_row_sse2,
+                                         argb_to_xrgb2101010_row_avx2 },
+        [KERNEL_ABGR_TO_XRGB2101010] = { abgr_to_xrgb2101010_row_scalar, abgr_to_xrgb2101010_row_sse2,
+                                         abgr_to_xrgb2101010_row_avx2 },
+#else
+        [KERNEL_SWAP_RB]             = { swap_rb_row_scalar },
+        [KERNEL_ARGB_TO_RGB565]      = { argb_to_rgb565_row_scalar },
+        [KERNEL_ABGR_TO_RGB565]      = { abgr_to_rgb565_row_scalar },
+        [KERNEL_ARGB_TO_XRGB2101010] = { argb_to_xrgb2101010_row_scalar },
+        [KERNEL_ABGR_TO_XRGB2101010] = { abgr_to_xrgb2101010_row_scalar },
+#endif
+};
+
+static const char * const isa_names[WAKEFIELD_ISA_COUNT] = {
+        [WAKEFIELD_ISA_SCALAR] = "scalar",
+        [WAKEFIELD_ISA_SSE2]   = "sse2",
+        [WAKEFIELD_ISA_AVX2]   = "avx2"
+};
+
+enum wakefield_isa
+wakefield_get_isa(void)
+{
+    static int isa = -1;
+
+    if (isa < 0) {
+        isa = WAKEFIELD_ISA_SCALAR;
+#ifdef WAKEFIELD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            isa = WAKEFIELD_ISA_AVX2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            isa = WAKEFIELD_ISA_SSE2;
+        }
+#endif
+    }
+
+    return isa;
+}
+
+const char *
+wakefield_convert_isa_name(void)
+{
+    return isa_names[wakefield_get_isa()];
+}
+
+static wakefield_convert_row_func_t
+get_kernel(enum kernel kernel)
+{
+    return kernels[kernel][wakefield_get_isa()];
+}
+
+wakefield_convert_row_func_t
+wakefield_get_convert_row_func(pixman_format_code_t src_format, uint32_t dst_shm_format)
+{
+    bool src_is_abgr;
+    switch (src_format) {
+        case PIXMAN_a8r8g8b8:
+        case PIXMAN_x8r8g8b8:
+            src_is_abgr = false;
+            break;
+        case PIXMAN_a8b8g8r8:
+        case PIXMAN_x8b8g8r8:
+            src_is_abgr = true;
+            break;
+        default:
+            return NULL;
+    }
+
+    switch (dst_shm_format) {
+        case WL_SHM_FORMAT_ARGB8888:
+        case WL_SHM_FORMAT_XRGB8888:
+            return src_is_abgr ? get_kernel(KERNEL_SWAP_RB) : copy_row_scalar;
+        case WL_SHM_FORMAT_ABGR8888:
+        case WL_SHM_FORMAT_XBGR8888:
+            return src_is_abgr ? copy_row_scalar : get_kernel(KERNEL_SWAP_RB);
+        case WL_SHM_FORMAT_RGB565:
+            return get_kernel(src_is_abgr ? KERNEL_ABGR_TO_RGB565 : KERNEL_ARGB_TO_RGB565);
+        case WL_SHM_FORMAT_XRGB2101010:
+            return get_kernel(src_is_abgr ? KERNEL_ABGR_TO_XRGB2101010 : KERNEL_ARGB_TO_XRGB2101010);
+        default:
+            return NULL;
+    }
+}
+
+size_t
+wakefield_shm_format_bpp(uint32_t shm_format)
+{
+    switch (shm_format) {
+        case WL_SHM_FORMAT_ARGB8888:
+        case WL_SHM_FORMAT_XRGB8888:
+        case WL_SHM_FORMAT_ABGR8888:
+        case WL_SHM_FORMAT_XBGR8888:
+        case WL_SHM_FORMAT_XRGB2101010:
+            return 4;
+        case WL_SHM_FORMAT_RGB565:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+pixman_format_code_t
+wakefield_shm_format_to_pixman(uint32_t shm_format)
+{
+    switch (shm_format) {
+        case WL_SHM_FORMAT_ARGB8888:
+            return PIXMAN_a8r8g8b8;
+        case WL_SHM_FORMAT_XRGB8888:
+            return PIXMAN_x8r8g8b8;
+        case WL_SHM_FORMAT_ABGR8888:
+            return PIXMAN_a8b8g8r8;
+        case WL_SHM_FORMAT_XBGR8888:
+            return PIXMAN_x8b8g8r8;
+        case WL_SHM_FORMAT_RGB565:
+            return PIXMAN_r5g6b5;
+        case WL_SHM_FORMAT_XRGB2101010:
+            return PIXMAN_x2r10g10b10;
+        default:
+            return 0;
+    }
+}
+
+const char *
+wakefield_shm_format_name(uint32_t shm_format)
+{
+    switch (shm_format) {
+        case WL_SHM_FORMAT_ARGB8888:
+            return "ARGB8888";
+        case WL_SHM_FORMAT_XRGB8888:
+            return "XRGB8888";
+        case WL_SHM_FORMAT_ABGR8888:
+            return "ABGR8888";
+        case WL_SHM_FORMAT_XBGR8888:
+            return "XBGR8888";
+        case WL_SHM_FORMAT_RGB565:
+            return "RGB565";
+        case WL_SHM_FORMAT_XRGB2101010:
+            return "XRGB2101010";
+        default:
+            return "unsupported";
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef WAKEFIELD_CONVERT_H
+#define WAKEFIELD_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pixman.h>
+
+/**
+ * Converts a row of width pixels at src to the pixels at dst.
+ * The source and the destination must not overlap.
+ */
+typedef void (*wakefield_convert_row_func_t)(void *dst, const void *src, int32_t width);
+
+/**
+ * Returns the function that converts rows of pixels in the given pixman format
+ * (normally, the compositor's read_format) to the given wl_shm format
+ * or NULL if such conversion is not supported.
+ * The fastest implementation that the CPU supports is picked on the first call.
+ */
+wakefield_convert_row_func_t
+wakefield_get_convert_row_func(pixman_format_code_t src_format, uint32_t dst_shm_format);
+
+/**
+ * Returns the size of a pixel in bytes in the given wl_shm format
+ * or 0 if the format is not supported.
+ */
+size_t
+wakefield_shm_format_bpp(uint32_t shm_format);
+
+/**
+ * Returns the pixman equivalent of the given wl_shm format or 0 if there's none.
+ */
+pixman_format_code_t
+wakefield_shm_format_to_pixman(uint32_t shm_format);
+
+/**
+ * Returns a human-readable name of the given wl_shm format for logging.
+ */
+const char *
+wakefield_shm_format_name(uint32_t shm_format);
+
+/**
+ * Instruction sets that the pixel kernels have implementations for.
+ */
+enum wakefield_isa {
+    WAKEFIELD_ISA_SCALAR,
+    WAKEFIELD_ISA_SSE2,
+    WAKEFIELD_ISA_AVX2,
+    WAKEFIELD_ISA_COUNT
+};
+
+/**
+ * Returns the best instruction set that both the CPU and the pixel kernels support.
+ */
+enum wakefield_isa
+wakefield_get_isa(void);
+
+/**
+ * Returns the name of the instruction set the conversion functions were picked for.
+ */
+const char *
+wakefield_convert_isa_name(void);
+
+#endif //WAKEFIELD_CONVERT_H
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WAKEFIELD_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "wakefield-server-protocol.h"
+#include "encode.h"
+
+static inline uint8_t *
+put_u32_be(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+/*
+ * QOI as specified in https://qoiformat.org/qoi-specification.pdf
+ * Screen contents have long runs and repeated colors, which QOI encodes
+ * in a byte or two per pixel at memcpy-like speed.
+ */
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+static size_t
+encode_qoi(const uint32_t *pixels, int32_t width, int32_t height, void **data)
+{
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+    const size_t n_pixels = (size_t)width * height;
+    uint8_t * const out = malloc(14 + n_pixels * 4 + sizeof(padding)); // the worst case is QOI_OP_RGB for every pixel
+    if (out == NULL)
+        return 0;
+
+    uint8_t *p = out;
+    memcpy(p, "qoif", 4);
+    p = put_u32_be(p + 4, width);
+    p = put_u32_be(p, height);
+    *p++ = 3; // channels: RGB
+    *p++ = 0; // colorspace: sRGB with linear alpha
+
+    uint32_t index[64] = { 0 };
+    uint32_t previous  = 0xff000000u;
+    int      run       = 0;
+    for (size_t i = 0; i < n_pixels; i++) {
+        const uint32_t pixel = pixels[i] | 0xff000000u;
+        if (pixel == previous) {
+            if (++run == 62) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            *p++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        const uint8_t r = pixel >> 16;
+        const uint8_t g = pixel >> 8;
+        const uint8_t b = pixel;
+        const int hash = (r * 3 + g * 5 + b * 7 + 0xff * 11) % 64;
+        if (index[hash] == pixel) {
+            *p++ = QOI_OP_INDEX | hash;
+        } else {
+            index[hash] = pixel;
+
+            const int8_t dr   = (int8_t)(r - (uint8_t)(previous >> 16));
+            const int8_t dg   = (int8_t)(g - (uint8_t)(previous >> 8));
+            const int8_t db   = (int8_t)(b - (uint8_t)previous);
+            const int8_t dr_g = (int8_t)(dr - dg);
+            const int8_t db_g = (int8_t)(db - dg);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+            } else if (dg >= -32 && dg <= 31 && dr_g >= -8 && dr_g <= 7 && db_g >= -8 && db_g <= 7) {
+                *p++ = QOI_OP_LUMA | (dg + 32);
+                *p++ = (dr_g + 8) << 4 | (db_g + 8);
+            } else {
+                *p++ = QOI_OP_RGB;
+                *p++ = r;
+                *p++ = g;
+                *p++ = b;
+            }
+        }
+        previous = pixel;
+    }
+    if (run > 0) {
+        *p++ = QOI_OP_RUN | (run - 1);
+    }
+
+    memcpy(p, padding, sizeof(padding));
+    p += sizeof(padding);
+
+    *data = out;
+    return p - out;
+}
+
+#ifdef WAKEFIELD_HAVE_ZLIB
+
+static uint8_t *
+put_png_chunk(uint8_t *p, const char *type, const void *chunk_data, size_t size)
+{
+    p = put_u32_be(p, size);
+    memcpy(p, type, 4);
+    if (size > 0) {
+        memmove(p + 4, chunk_data, size);
+    }
+    const uint32_t crc = crc32(0, p, 4 + size);
+    return put_u32_be(p + 4 + size, crc);
+}
+
+/**
+ * Encodes the image as 8-bit RGB PNG with the "sub" filter, which suits screen contents well,
+ * and the fastest deflate level.
+ */
+static size_t
+encode_png(const uint32_t *pixels, int32_t width, int32_t height, void **data)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    const size_t row_size = 1 + (size_t)width * 3;
+    uint8_t * const raw = malloc(row_size * height);
+    if (raw == NULL)
+        return 0;
+
+    for (int32_t y = 0; y < height; y++) {
+        uint8_t *r = &raw[y * row_size];
+        const uint32_t *src = &pixels[(size_t)y * width];
+        *r++ = 1; // filter type: sub
+        uint32_t left = 0;
+        for (int32_t x = 0; x < width; x++) {
+            const uint32_t pixel = src[x];
+            *r++ = (uint8_t)((pixel >> 16) - (left >> 16));
+            *r++ = (uint8_t)((pixel >> 8) - (left >> 8));
+            *r++ = (uint8_t)(pixel - left);
+            left = pixel;
+        }
+    }
+
+    const uLong bound = compressBound(row_size * height);
+    // signature, IHDR, IDAT header and CRC, IEND
+    uint8_t * const out = malloc(sizeof(signature) + 25 + 12 + bound + 12);
+    if (out == NULL) {
+        free(raw);
+        return 0;
+    }
+
+    uint8_t *p = out;
+    memcpy(p, signature, sizeof(signature));
+    p += sizeof(signature);
+
+    uint8_t ihdr[13];
+    put_u32_be(&ihdr[0], width);
+    put_u32_be(&ihdr[4], height);
+    ihdr[8]  = 8; // bit depth
+    ihdr[9]  = 2; // color type: RGB
+    ihdr[10] = 0; // compression: deflate
+    ihdr[11] = 0; // filter method: adaptive
+    ihdr[12] = 0; // interlace: none
+    p = put_png_chunk(p, "IHDR", ihdr, sizeof(ihdr));
+
+    // Deflate right into the IDAT chunk's data.
+    uLong compressed_size = bound;
+    if (compress2(p + 8, &compressed_size, raw, row_size * height, Z_BEST_SPEED) != Z_OK) {
+        free(raw);
+        free(out);
+        return 0;
+    }
+    free(raw);
+    p = put_png_chunk(p, "IDAT", p + 8, compressed_size);
+    p = put_png_chunk(p, "IEND", NULL, 0);
+
+    *data = out;
+    return p - out;
+}
+
+#endif // WAKEFIELD_HAVE_ZLIB
+
+bool
+wakefield_codec_supported(uint32_t codec)
+{
+    switch (codec) {
+        case WAKEFIELD_CODEC_QOI:
+            return true;
+#ifdef WAKEFIELD_HAVE_ZLIB
+        case WAKEFIELD_CODEC_PNG:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+size_t
+wakefield_encode(uint32_t codec, const uint32_t *pixels, int32_t width, int32_t height, void **data)
+{
+    switch (codec) {
+        case WAKEFIELD_CODEC_QOI:
+            return encode_qoi(pixels, width, height, data);
+#ifdef WAKEFIELD_HAVE_ZLIB
+        case WAKEFIELD_CODEC_PNG:
+            return encode_png(pixels, width, height, data);
+#endif
+        default:
+            return 0;
+    }
+}
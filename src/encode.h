@@ -0,0 +1,24 @@
+#ifndef WAKEFIELD_ENCODE_H
+#define WAKEFIELD_ENCODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Returns true iff images can be encoded with the given codec from the wakefield codec enum.
+ */
+bool
+wakefield_codec_supported(uint32_t codec);
+
+/**
+ * Encodes an opaque image of width x height a8r8g8b8 pixels laid out row by row with no padding
+ * with the given codec from the wakefield codec enum. The alpha channel is ignored.
+ *
+ * @param data (OUT) the encoded image in memory allocated with malloc()
+ * @return the size of the encoded image in bytes, 0 in case of an error.
+ */
+size_t
+wakefield_encode(uint32_t codec, const uint32_t *pixels, int32_t width, int32_t height, void **data);
+
+#endif //WAKEFIELD_ENCODE_H
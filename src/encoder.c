@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "encoder.h"
+#include "encode.h"
+
+static bool
+write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static void
+run_job(struct wakefield_encode_job *job)
+{
+    void *data = NULL;
+    job->size = wakefield_encode(job->codec, job->pixels, job->width, job->height, &data);
+    job->ok   = job->size > 0 && write_all(job->fd, data, job->size);
+    free(data);
+
+    free(job->pixels);
+    job->pixels = NULL;
+    close(job->fd);
+    job->fd = -1;
+}
+
+static void
+drop_job(struct wakefield_encode_job *job)
+{
+    wl_list_remove(&job->link);
+    free(job->pixels);
+    job->pixels = NULL;
+    if (job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+}
+
+static void *
+encoder_main(void *arg)
+{
+    struct wakefield_encoder *encoder = arg;
+
+    pthread_mutex_lock(&encoder->lock);
+    while (true) {
+        while (!encoder->quit && wl_list_empty(&encoder->queue)) {
+            pthread_cond_wait(&encoder->cond, &encoder->lock);
+        }
+        if (encoder->quit)
+            break;
+
+        struct wakefield_encode_job *job = wl_container_of(encoder->queue.next, job, link);
+        wl_list_remove(&job->link);
+        pthread_mutex_unlock(&encoder->lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&encoder->lock);
+        wl_list_insert(encoder->done_list.prev, &job->link);
+
+        const uint64_t one = 1;
+        if (write(encoder->event_fd, &one, sizeof(one)) < 0) {
+            // Can only fail if the counter overflows, and then it's readable anyway.
+        }
+    }
+    pthread_mutex_unlock(&encoder->lock);
+
+    return NULL;
+}
+
+static int
+encoder_event_notify(int fd, uint32_t mask, void *data)
+{
+    struct wakefield_encoder *encoder = data;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+        // Spurious wakeup, nothing to do
+    }
+
+    struct wl_list done_list;
+    wl_list_init(&done_list);
+    pthread_mutex_lock(&encoder->lock);
+    wl_list_insert_list(&done_list, &encoder->done_list);
+    wl_list_init(&encoder->done_list);
+    pthread_mutex_unlock(&encoder->lock);
+
+    struct wakefield_encode_job *job, *tmp;
+    wl_list_for_each_safe(job, tmp, &done_list, link) {
+        wl_list_remove(&job->link);
+        encoder->done_func(job, encoder->done_data);
+    }
+
+    return 0;
+}
+
+bool
+wakefield_encoder_init(struct wakefield_encoder *encoder, struct wl_event_loop *loop,
+                       wakefield_encode_done_func_t done_func, void *done_data)
+{
+    encoder->thread_started = false;
+    encoder->quit           = false;
+    encoder->done_func      = done_func;
+    encoder->done_data      = done_data;
+    encoder->event_source   = NULL;
+    wl_list_init(&encoder->queue);
+    wl_list_init(&encoder->done_list);
+    pthread_mutex_init(&encoder->lock, NULL);
+    pthread_cond_init(&encoder->cond, NULL);
+
+    encoder->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (encoder->event_fd < 0) {
+        wakefield_encoder_fini(encoder);
+        return false;
+    }
+
+    encoder->event_source = wl_event_loop_add_fd(loop, encoder->event_fd, WL_EVENT_READABLE,
+                                                 encoder_event_notify, encoder);
+    if (encoder->event_source == NULL) {
+        wakefield_encoder_fini(encoder);
+        return false;
+    }
+
+    if (pthread_create(&encoder->thread, NULL, encoder_main, encoder) != 0) {
+        wakefield_encoder_fini(encoder);
+        return false;
+    }
+    encoder->thread_started = true;
+
+    return true;
+}
+
+void
+wakefield_encoder_fini(struct wakefield_encoder *encoder)
+{
+    if (encoder->thread_started) {
+        pthread_mutex_lock(&encoder->lock);
+        encoder->quit = true;
+        pthread_cond_signal(&encoder->cond);
+        pthread_mutex_unlock(&encoder->lock);
+        pthread_join(encoder->thread, NULL);
+        encoder->thread_started = false;
+    }
+
+    struct wakefield_encode_job *job, *tmp;
+    wl_list_for_each_safe(job, tmp, &encoder->queue, link) {
+        drop_job(job);
+    }
+    wl_list_for_each_safe(job, tmp, &encoder->done_list, link) {
+        drop_job(job);
+    }
+
+    if (encoder->event_source) {
+        wl_event_source_remove(encoder->event_source);
+        encoder->event_source = NULL;
+    }
+    if (encoder->event_fd >= 0) {
+        close(encoder->event_fd);
+        encoder->event_fd = -1;
+    }
+
+    pthread_cond_destroy(&encoder->cond);
+    pthread_mutex_destroy(&encoder->lock);
+}
+
+void
+wakefield_encoder_submit(struct wakefield_encoder *encoder, struct wakefield_encode_job *job)
+{
+    pthread_mutex_lock(&encoder->lock);
+    wl_list_insert(encoder->queue.prev, &job->link);
+    pthread_cond_signal(&encoder->cond);
+    pthread_mutex_unlock(&encoder->lock);
+}
@@ -0,0 +1,67 @@
+#ifndef WAKEFIELD_ENCODER_H
+#define WAKEFIELD_ENCODER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+/**
+ * An image to be encoded and written to a file descriptor in the background.
+ * The job structure itself belongs to the caller, who frees it in the done callback.
+ */
+struct wakefield_encode_job {
+    struct wl_list  link;    // wakefield_encoder::queue or wakefield_encoder::done_list
+    uint32_t        codec;   // from the wakefield codec enum
+    uint32_t       *pixels;  // a8r8g8b8, allocated with malloc(); freed by the encoder
+    int32_t         width;
+    int32_t         height;
+    int             fd;      // closed by the encoder
+    size_t          size;    // (OUT) the number of bytes written
+    bool            ok;      // (OUT) false if the image could not be encoded or written
+};
+
+typedef void (*wakefield_encode_done_func_t)(struct wakefield_encode_job *job, void *data);
+
+/**
+ * A thread that encodes images and writes them out while the compositor keeps going.
+ * Finished jobs are reported on the compositor thread through the event loop.
+ */
+struct wakefield_encoder {
+    pthread_t               thread;
+    bool                    thread_started;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;       // signalled when a job is queued or the thread should quit
+    struct wl_list          queue;      // wakefield_encode_job::link, waiting for the thread
+    struct wl_list          done_list;  // wakefield_encode_job::link, waiting for the compositor thread
+    bool                    quit;
+
+    int                     event_fd;   // readable when done_list is not empty
+    struct wl_event_source *event_source;
+
+    wakefield_encode_done_func_t done_func;
+    void                   *done_data;
+};
+
+/**
+ * Starts the encoder thread. done_func is called on the compositor thread for every finished job.
+ *
+ * @return false if the encoder could not be started.
+ */
+bool
+wakefield_encoder_init(struct wakefield_encoder *encoder, struct wl_event_loop *loop,
+                       wakefield_encode_done_func_t done_func, void *done_data);
+
+/**
+ * Stops the encoder thread. The jobs not reported yet are dropped without calling done_func:
+ * their pixels are freed and file descriptors closed, but the job structures are left to the caller.
+ */
+void
+wakefield_encoder_fini(struct wakefield_encoder *encoder);
+
+void
+wakefield_encoder_submit(struct wakefield_encoder *encoder, struct wakefield_encode_job *job);
+
+#endif //WAKEFIELD_ENCODER_H
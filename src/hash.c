@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ * XXH64 as specified in https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ * The main loop keeps four independent accumulators, which lets the compiler
+ * interleave (and, on some targets, vectorize) the multiplications.
+ */
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // the data is little-endian on all the platforms we run on
+    return v;
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc  = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t
+wakefield_xxh64(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p   = data;
+    const uint8_t *end = p + length;
+    uint64_t h64;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        const uint8_t * const limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h64 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h64 = xxh64_merge_round(h64, v1);
+        h64 = xxh64_merge_round(h64, v2);
+        h64 = xxh64_merge_round(h64, v3);
+        h64 = xxh64_merge_round(h64, v4);
+    } else {
+        h64 = seed + PRIME64_5;
+    }
+
+    h64 += (uint64_t)length;
+
+    while (p + 8 <= end) {
+        h64 ^= xxh64_round(0, read64(p));
+        h64  = rotl64(h64, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h64 ^= (uint64_t)read32(p) * PRIME64_1;
+        h64  = rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h64 ^= (*p) * PRIME64_5;
+        h64  = rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
@@ -0,0 +1,15 @@
+#ifndef WAKEFIELD_HASH_H
+#define WAKEFIELD_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the 64-bit xxHash (XXH64) of the given data with the given seed.
+ * The result is the same as that of the reference implementation, so clients
+ * can compute hashes of golden images with any XXH64 library.
+ */
+uint64_t
+wakefield_xxh64(const void *data, size_t length, uint64_t seed);
+
+#endif //WAKEFIELD_HASH_H
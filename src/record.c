@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+
+#define RLE_REPEAT 0x80000000u
+
+// Runs of identical pixels shorter than this are cheaper to store as is.
+#define RLE_MIN_REPEAT 3
+
+size_t
+wakefield_rle_bound(size_t n_pixels)
+{
+    // The worst case is a single literal run.
+    return (n_pixels + 1) * sizeof(uint32_t);
+}
+
+size_t
+wakefield_rle_encode(const uint32_t *pixels, size_t n_pixels, uint8_t *out)
+{
+    uint32_t *o = (uint32_t *)out;
+    size_t literal_start = 0;
+    size_t i = 0;
+
+    while (i < n_pixels) {
+        size_t run = 1;
+        while (i + run < n_pixels && pixels[i + run] == pixels[i] && run < RLE_REPEAT - 1) {
+            run++;
+        }
+
+        if (run < RLE_MIN_REPEAT) {
+            i += run;
+            continue;
+        }
+
+        if (literal_start < i) {
+            *o++ = i - literal_start;
+            memcpy(o, &pixels[literal_start], (i - literal_start) * sizeof(uint32_t));
+            o += i - literal_start;
+        }
+        *o++ = RLE_REPEAT | run;
+        *o++ = pixels[i];
+        i += run;
+        literal_start = i;
+    }
+
+    if (literal_start < n_pixels) {
+        *o++ = n_pixels - literal_start;
+        memcpy(o, &pixels[literal_start], (n_pixels - literal_start) * sizeof(uint32_t));
+        o += n_pixels - literal_start;
+    }
+
+    return (uint8_t *)o - out;
+}
+
+bool
+wakefield_rle_decode(const uint8_t *data, size_t size, uint32_t *pixels, size_t n_pixels)
+{
+    size_t in = 0;
+    size_t n  = 0;
+    while (n < n_pixels) {
+        uint32_t word;
+        if (in + sizeof(word) > size)
+            return false;
+        memcpy(&word, &data[in], sizeof(word));
+        in += sizeof(word);
+
+        const size_t count = word & ~RLE_REPEAT;
+        if (count > n_pixels - n)
+            return false;
+
+        if (word & RLE_REPEAT) {
+            uint32_t pixel;
+            if (in + sizeof(pixel) > size)
+                return false;
+            memcpy(&pixel, &data[in], sizeof(pixel));
+            in += sizeof(pixel);
+            for (size_t i = 0; i < count; i++) {
+                pixels[n++] = pixel;
+            }
+        } else {
+            if (in + count * sizeof(uint32_t) > size)
+                return false;
+            memcpy(&pixels[n], &data[in], count * sizeof(uint32_t));
+            in += count * sizeof(uint32_t);
+            n  += count;
+        }
+    }
+
+    return in == size;
+}
+
+static void
+write_record(struct wakefield_record_writer *writer, uint32_t type, uint64_t time,
+             const void *payload, size_t size)
+{
+    const struct wakefield_record_header header = { .type = type, .size = size, .time = time };
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1
+        || (size > 0 && fwrite(payload, size, 1, writer->file) != 1)) {
+        writer->failed = true;
+    }
+}
+
+/**
+ * Makes room for size more bytes at the end of the frame and returns a pointer to them.
+ */
+static uint8_t *
+frame_reserve(struct wakefield_record_writer *writer, size_t size)
+{
+    if (writer->frame_size + size > writer->frame_capacity) {
+        size_t capacity = writer->frame_capacity ? writer->frame_capacity : 4096;
+        while (capacity < writer->frame_size + size) {
+            capacity *= 2;
+        }
+        uint8_t *frame = realloc(writer->frame, capacity);
+        if (frame == NULL) {
+            writer->failed = true;
+            return NULL;
+        }
+        writer->frame          = frame;
+        writer->frame_capacity = capacity;
+    }
+
+    return &writer->frame[writer->frame_size];
+}
+
+static void
+frame_append(struct wakefield_record_writer *writer, const void *data, size_t size)
+{
+    uint8_t *p = frame_reserve(writer, size);
+    if (p) {
+        memcpy(p, data, size);
+        writer->frame_size += size;
+    }
+}
+
+bool
+wakefield_record_open(struct wakefield_record_writer *writer, const char *path)
+{
+    memset(writer, 0, sizeof(*writer));
+
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL)
+        return false;
+
+    setvbuf(writer->file, NULL, _IOFBF, 1 << 20);
+    if (fwrite(WAKEFIELD_RECORD_MAGIC, strlen(WAKEFIELD_RECORD_MAGIC), 1, writer->file) != 1) {
+        wakefield_record_close(writer);
+        return false;
+    }
+
+    return true;
+}
+
+void
+wakefield_record_close(struct wakefield_record_writer *writer)
+{
+    if (writer->file) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+    free(writer->frame);
+    writer->frame          = NULL;
+    writer->frame_size     = 0;
+    writer->frame_capacity = 0;
+}
+
+void
+wakefield_record_write_output(struct wakefield_record_writer *writer, uint64_t time, uint32_t id,
+                              int32_t x, int32_t y, int32_t width, int32_t height, const char *name)
+{
+    const uint32_t fields[5] = { id, (uint32_t)x, (uint32_t)y, (uint32_t)width, (uint32_t)height };
+    const size_t name_length = strlen(name);
+
+    writer->frame_size = 0;
+    frame_append(writer, fields, sizeof(fields));
+    frame_append(writer, name, name_length);
+    if (writer->frame_size == sizeof(fields) + name_length) {
+        write_record(writer, WAKEFIELD_RECORD_OUTPUT, time, writer->frame, writer->frame_size);
+    }
+    writer->frame_size = 0;
+}
+
+void
+wakefield_record_write_request(struct wakefield_record_writer *writer, uint64_t time, const char *text)
+{
+    write_record(writer, WAKEFIELD_RECORD_REQUEST, time, text, strlen(text));
+}
+
+void
+wakefield_record_begin_frame(struct wakefield_record_writer *writer, uint64_t time,
+                             uint32_t output_id, uint32_t flags, uint32_t n_boxes)
+{
+    const uint32_t fields[3] = { output_id, flags, n_boxes };
+
+    writer->frame_size = 0;
+    writer->frame_time = time;
+    frame_append(writer, fields, sizeof(fields));
+}
+
+void
+wakefield_record_add_box(struct wakefield_record_writer *writer, int32_t x, int32_t y,
+                         int32_t width, int32_t height, const uint32_t *pixels)
+{
+    const size_t n_pixels = (size_t)width * height;
+    const uint32_t fields[4] = { (uint32_t)x, (uint32_t)y, (uint32_t)width, (uint32_t)height };
+    frame_append(writer, fields, sizeof(fields));
+
+    uint8_t *p = frame_reserve(writer, sizeof(uint32_t) + wakefield_rle_bound(n_pixels));
+    if (p == NULL)
+        return;
+
+    const uint32_t size = wakefield_rle_encode(pixels, n_pixels, p + sizeof(uint32_t));
+    memcpy(p, &size, sizeof(size));
+    writer->frame_size += sizeof(uint32_t) + size;
+}
+
+void
+wakefield_record_end_frame(struct wakefield_record_writer *writer)
+{
+    write_record(writer, WAKEFIELD_RECORD_FRAME, writer->frame_time, writer->frame, writer->frame_size);
+    writer->frame_size = 0;
+}
+
+bool
+wakefield_record_read_magic(FILE *file)
+{
+    char magic[sizeof(WAKEFIELD_RECORD_MAGIC) - 1];
+    return fread(magic, sizeof(magic), 1, file) == 1
+           && memcmp(magic, WAKEFIELD_RECORD_MAGIC, sizeof(magic)) == 0;
+}
+
+bool
+wakefield_record_read(FILE *file, struct wakefield_record_header *header, uint8_t **payload)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1)
+        return false;
+
+    *payload = malloc(header->size + 1); // + 1 so that text can be terminated
+    if (*payload == NULL)
+        return false;
+
+    if (header->size > 0 && fread(*payload, header->size, 1, file) != 1) {
+        free(*payload);
+        *payload = NULL;
+        return false;
+    }
+    (*payload)[header->size] = 0;
+
+    return true;
+}
@@ -0,0 +1,118 @@
+#ifndef WAKEFIELD_RECORD_H
+#define WAKEFIELD_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A session recording is a file that starts with the 8-byte magic "WKFREC01" followed by
+ * records, each one a wakefield_record_header and size bytes of payload. All numbers and pixels
+ * are in the byte order of the machine that made the recording, so it can only be replayed on
+ * a machine with the same byte order. Times are in nanoseconds since the recording started.
+ *
+ * OUTPUT  payload: uint32 id, int32 x, y, width, height, then the output's name (no terminating 0).
+ *         Written before the first frame of an output and whenever it changes. Written with
+ *         a width and height of 0 when the output is removed; its id may then be reused.
+ * FRAME   payload: uint32 output id, uint32 flags, uint32 number of boxes, then for every box
+ *         int32 x, y, width, height (in the output's coordinates), uint32 size of the encoded
+ *         pixels in bytes and the pixels encoded with wakefield_rle_encode().
+ *         A keyframe covers the entire output; other frames only what was repainted.
+ * REQUEST payload: a wakefield protocol request as text, e.g. "wakefield@3.get_pixel_color(10, 20)".
+ */
+
+#define WAKEFIELD_RECORD_MAGIC "WKFREC01"
+
+enum wakefield_record_type {
+    WAKEFIELD_RECORD_OUTPUT  = 1,
+    WAKEFIELD_RECORD_FRAME   = 2,
+    WAKEFIELD_RECORD_REQUEST = 3,
+};
+
+#define WAKEFIELD_RECORD_FRAME_KEYFRAME 1u
+
+struct wakefield_record_header {
+    uint32_t type;
+    uint32_t size;
+    uint64_t time;
+};
+
+/**
+ * Writes a recording; the frames are built in memory until they are complete.
+ */
+struct wakefield_record_writer {
+    FILE    *file;
+    uint8_t *frame;          // the payload of the frame being built
+    size_t   frame_size;
+    size_t   frame_capacity;
+    uint64_t frame_time;
+    bool     failed;         // a write has failed, the recording is incomplete
+};
+
+bool
+wakefield_record_open(struct wakefield_record_writer *writer, const char *path);
+
+void
+wakefield_record_close(struct wakefield_record_writer *writer);
+
+void
+wakefield_record_write_output(struct wakefield_record_writer *writer, uint64_t time, uint32_t id,
+                              int32_t x, int32_t y, int32_t width, int32_t height, const char *name);
+
+void
+wakefield_record_write_request(struct wakefield_record_writer *writer, uint64_t time, const char *text);
+
+void
+wakefield_record_begin_frame(struct wakefield_record_writer *writer, uint64_t time,
+                             uint32_t output_id, uint32_t flags, uint32_t n_boxes);
+
+/**
+ * Adds a box of width x height a8r8g8b8 pixels laid out row by row with no padding to the frame.
+ */
+void
+wakefield_record_add_box(struct wakefield_record_writer *writer, int32_t x, int32_t y,
+                         int32_t width, int32_t height, const uint32_t *pixels);
+
+void
+wakefield_record_end_frame(struct wakefield_record_writer *writer);
+
+/**
+ * Reads the magic at the start of a recording.
+ *
+ * @return false if the file is not a recording.
+ */
+bool
+wakefield_record_read_magic(FILE *file);
+
+/**
+ * Reads the next record and its payload into memory allocated with malloc().
+ *
+ * @return false at the end of the file or if the record is truncated.
+ */
+bool
+wakefield_record_read(FILE *file, struct wakefield_record_header *header, uint8_t **payload);
+
+/**
+ * Encodes the given 32-bit pixels as a sequence of runs, each starting with a 32-bit word:
+ * if its top bit is set, the lower bits are the number of times the single pixel that follows
+ * repeats; otherwise, they are the number of pixels that follow as is.
+ *
+ * @param out memory for at least wakefield_rle_bound(n_pixels) bytes
+ * @return the size of the encoded pixels in bytes.
+ */
+size_t
+wakefield_rle_encode(const uint32_t *pixels, size_t n_pixels, uint8_t *out);
+
+size_t
+wakefield_rle_bound(size_t n_pixels);
+
+/**
+ * Decodes n_pixels pixels encoded with wakefield_rle_encode().
+ *
+ * @return false if the data is malformed.
+ */
+bool
+wakefield_rle_decode(const uint8_t *data, size_t size, uint32_t *pixels, size_t n_pixels);
+
+#endif //WAKEFIELD_RECORD_H
@@ -0,0 +1,364 @@
+// Lists the contents of a session recording made with --wakefield-record
+// or extracts the images of the recorded outputs at the given times.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wakefield-server-protocol.h"
+#include "encode.h"
+#include "record.h"
+
+#ifndef MAX
+#define MAX(x,y) (((x) > (y)) ? (x) : (y))
+#endif
+
+#define MAX_TIMES 1024
+
+/**
+ * The image of an output reconstructed from the frames recorded so far.
+ */
+struct replay_output {
+    struct replay_output *next;
+    uint32_t  id;
+    char     *name;
+    int32_t   x;
+    int32_t   y;
+    int32_t   width;
+    int32_t   height;
+    uint32_t *pixels;
+    bool      complete; // a keyframe has been seen since the output changed
+};
+
+struct replay {
+    struct replay_output *outputs;
+    uint32_t    codec;
+    const char *prefix;
+    uint64_t    times[MAX_TIMES]; // nanoseconds, sorted
+    int         n_times;
+    int         next_time;        // the index of the next time to extract the images at
+    bool        list;
+};
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s RECORDING\n"
+            "           list the outputs, frames and requests in the recording\n"
+            "       %s RECORDING -t MS [-t MS ...] [-o PREFIX] [--png]\n"
+            "           write the image of every recorded output as it was MS milliseconds\n"
+            "           after the recording started to PREFIX-OUTPUT-MS.qoi (or .png)\n",
+            name, name);
+}
+
+static bool
+read_u32(const uint8_t *payload, size_t size, size_t *offset, uint32_t *value)
+{
+    if (*offset + sizeof(*value) > size)
+        return false;
+
+    memcpy(value, &payload[*offset], sizeof(*value));
+    *offset += sizeof(*value);
+    return true;
+}
+
+static struct replay_output *
+find_output(struct replay *replay, uint32_t id)
+{
+    for (struct replay_output *output = replay->outputs; output; output = output->next) {
+        if (output->id == id)
+            return output;
+    }
+
+    return NULL;
+}
+
+static void
+replay_output_destroy(struct replay_output *output)
+{
+    free(output->name);
+    free(output->pixels);
+    free(output);
+}
+
+/**
+ * Forgets the output with the given id, if any; its images are no longer extracted.
+ */
+static void
+remove_output(struct replay *replay, uint32_t id)
+{
+    for (struct replay_output **link = &replay->outputs; *link; link = &(*link)->next) {
+        if ((*link)->id == id) {
+            struct replay_output *output = *link;
+            *link = output->next;
+            replay_output_destroy(output);
+            return;
+        }
+    }
+}
+
+static bool
+apply_output(struct replay *replay, const struct wakefield_record_header *header, const uint8_t *payload)
+{
+    size_t   offset = 0;
+    uint32_t fields[5];
+    for (int i = 0; i < 5; i++) {
+        if (!read_u32(payload, header->size, &offset, &fields[i]))
+            return false;
+    }
+
+    const int32_t width  = (int32_t)fields[3];
+    const int32_t height = (int32_t)fields[4];
+    const char   *name   = (const char *)&payload[offset];
+    if (width == 0 && height == 0) {
+        if (replay->list) {
+            printf("%12.3f ms  output %u '%s' removed\n", header->time / 1e6, fields[0], name);
+        }
+        remove_output(replay, fields[0]);
+        return true;
+    }
+
+    if (width <= 0 || height <= 0)
+        return false;
+
+    if (replay->list) {
+        printf("%12.3f ms  output %u '%s' at (%d, %d) sized (%d, %d)\n",
+               header->time / 1e6, fields[0], name, (int32_t)fields[1], (int32_t)fields[2], width, height);
+    }
+
+    struct replay_output *output = find_output(replay, fields[0]);
+    if (output == NULL) {
+        output = calloc(1, sizeof(struct replay_output));
+        if (output == NULL)
+            return false;
+        output->id      = fields[0];
+        output->next    = replay->outputs;
+        replay->outputs = output;
+    }
+
+    free(output->name);
+    output->name = strdup(name);
+    if (output->width != width || output->height != height) {
+        free(output->pixels);
+        output->pixels = calloc((size_t)width * height, sizeof(uint32_t));
+    }
+    output->x        = (int32_t)fields[1];
+    output->y        = (int32_t)fields[2];
+    output->width    = width;
+    output->height   = height;
+    output->complete = false;
+
+    return output->name && output->pixels;
+}
+
+static bool
+apply_frame(struct replay *replay, const struct wakefield_record_header *header, const uint8_t *payload)
+{
+    size_t   offset = 0;
+    uint32_t id, flags, n_boxes;
+    if (!read_u32(payload, header->size, &offset, &id)
+        || !read_u32(payload, header->size, &offset, &flags)
+        || !read_u32(payload, header->size, &offset, &n_boxes))
+        return false;
+
+    struct replay_output *output = find_output(replay, id);
+    if (output == NULL)
+        return false;
+
+    if (replay->list) {
+        printf("%12.3f ms  %s of '%s', %u box(es), %u bytes\n",
+               header->time / 1e6, (flags & WAKEFIELD_RECORD_FRAME_KEYFRAME) ? "keyframe" : "frame   ",
+               output->name, n_boxes, header->size);
+    }
+
+    uint32_t *pixels = NULL;
+    bool ok = true;
+    for (uint32_t i = 0; i < n_boxes && ok; i++) {
+        uint32_t x, y, width, height, size;
+        ok = read_u32(payload, header->size, &offset, &x)
+             && read_u32(payload, header->size, &offset, &y)
+             && read_u32(payload, header->size, &offset, &width)
+             && read_u32(payload, header->size, &offset, &height)
+             && read_u32(payload, header->size, &offset, &size)
+             && offset + size <= header->size
+             && x <= (uint32_t)output->width && width <= (uint32_t)output->width - x
+             && y <= (uint32_t)output->height && height <= (uint32_t)output->height - y;
+        if (!ok)
+            break;
+
+        const size_t n_pixels = (size_t)width * height;
+        uint32_t *box_pixels = realloc(pixels, MAX(n_pixels, 1) * sizeof(uint32_t));
+        if (box_pixels == NULL) {
+            ok = false;
+            break;
+        }
+        pixels = box_pixels;
+
+        ok = wakefield_rle_decode(&payload[offset], size, pixels, n_pixels);
+        offset += size;
+        for (uint32_t row = 0; row < height && ok; row++) {
+            memcpy(&output->pixels[(size_t)(y + row)*output->width + x], &pixels[(size_t)row*width],
+                   width * sizeof(uint32_t));
+        }
+    }
+    free(pixels);
+
+    if (ok && (flags & WAKEFIELD_RECORD_FRAME_KEYFRAME)) {
+        output->complete = true;
+    }
+
+    return ok;
+}
+
+static bool
+write_image(struct replay *replay, struct replay_output *output, uint64_t time)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s-%s-%llu.%s", replay->prefix, output->name,
+             (unsigned long long)(time / 1000000), replay->codec == WAKEFIELD_CODEC_PNG ? "png" : "qoi");
+
+    void *data;
+    const size_t size = wakefield_encode(replay->codec, output->pixels, output->width, output->height, &data);
+    if (size == 0) {
+        fprintf(stderr, "failed to encode the image of '%s'\n", output->name);
+        return false;
+    }
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file && fwrite(data, size, 1, file) == 1;
+    if (file && fclose(file) != 0) {
+        ok = false;
+    }
+    free(data);
+
+    if (!ok) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    printf("%s\n", path);
+    return true;
+}
+
+/**
+ * Writes the images of all the outputs for every time to extract them at
+ * that comes before the given time.
+ */
+static bool
+extract_until(struct replay *replay, uint64_t time)
+{
+    for (; replay->next_time < replay->n_times && replay->times[replay->next_time] < time; replay->next_time++) {
+        for (struct replay_output *output = replay->outputs; output; output = output->next) {
+            if (!output->complete) {
+                fprintf(stderr, "no complete image of '%s' at %llu ms\n", output->name,
+                        (unsigned long long)(replay->times[replay->next_time] / 1000000));
+                continue;
+            }
+            if (!write_image(replay, output, replay->times[replay->next_time]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static int
+compare_times(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct replay replay = { .codec = WAKEFIELD_CODEC_QOI, .prefix = "frame" };
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc && replay.n_times < MAX_TIMES) {
+            replay.times[replay.n_times++] = strtoull(argv[++i], NULL, 10) * 1000000;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            replay.prefix = argv[++i];
+        } else if (strcmp(argv[i], "--png") == 0) {
+            replay.codec = WAKEFIELD_CODEC_PNG;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (path == NULL) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!wakefield_codec_supported(replay.codec)) {
+        fprintf(stderr, "PNG is not supported, the tool was built without zlib\n");
+        return 2;
+    }
+
+    replay.list = replay.n_times == 0;
+    qsort(replay.times, replay.n_times, sizeof(replay.times[0]), compare_times);
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (!wakefield_record_read_magic(file)) {
+        fprintf(stderr, "%s is not a wakefield recording\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    bool ok = true;
+    struct wakefield_record_header header;
+    uint8_t *payload;
+    while (ok && wakefield_record_read(file, &header, &payload)) {
+        // The images at a given time include the frames recorded at exactly that time.
+        ok = extract_until(&replay, header.time);
+
+        switch (header.type) {
+            case WAKEFIELD_RECORD_OUTPUT:
+                ok = ok && apply_output(&replay, &header, payload);
+                break;
+            case WAKEFIELD_RECORD_FRAME:
+                ok = ok && apply_frame(&replay, &header, payload);
+                break;
+            case WAKEFIELD_RECORD_REQUEST:
+                if (replay.list) {
+                    printf("%12.3f ms  %s\n", header.time / 1e6, (const char *)payload);
+                }
+                break;
+            default:
+                break; // from a newer version
+        }
+        free(payload);
+
+        if (!ok) {
+            fprintf(stderr, "%s is damaged at %.3f ms\n", path, header.time / 1e6);
+        }
+    }
+    fclose(file);
+
+    // A recording cut short by a crash still has everything up to the crash.
+    if (ok) {
+        ok = extract_until(&replay, UINT64_MAX);
+    }
+
+    while (replay.outputs) {
+        struct replay_output *output = replay.outputs;
+        replay.outputs = output->next;
+        replay_output_destroy(output);
+    }
+
+    return ok ? 0 : 1;
+}
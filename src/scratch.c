@@ -0,0 +1,99 @@
+#include <libweston/weston-log.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scratch.h"
+
+// Release the memory if no request needed it for this long.
+#define WAKEFIELD_SCRATCH_IDLE_RELEASE_MS 10000
+
+static void
+scratch_release(struct wakefield_scratch *scratch)
+{
+    if (scratch->data) {
+        weston_log_scope_printf(scratch->log,
+                                "WAKEFIELD: scratch arena of %ld bytes released\n", scratch->size);
+    }
+
+    free(scratch->data);
+    scratch->data = NULL;
+    scratch->size = 0;
+}
+
+static int
+scratch_idle_timer_notify(void *data)
+{
+    struct wakefield_scratch *scratch = data;
+
+    scratch_release(scratch);
+    return 0;
+}
+
+bool
+wakefield_scratch_init(struct wakefield_scratch *scratch, struct wl_event_loop *loop,
+                       struct weston_log_scope *log, size_t high_water_mark)
+{
+    scratch->log             = log;
+    scratch->data            = NULL;
+    scratch->size            = 0;
+    scratch->high_water_mark = high_water_mark;
+    scratch->reallocations   = 0;
+    scratch->idle_timer      = wl_event_loop_add_timer(loop, scratch_idle_timer_notify, scratch);
+
+    return scratch->idle_timer != NULL;
+}
+
+void
+wakefield_scratch_fini(struct wakefield_scratch *scratch)
+{
+    if (scratch->idle_timer) {
+        wl_event_source_remove(scratch->idle_timer);
+        scratch->idle_timer = NULL;
+    }
+
+    scratch_release(scratch);
+}
+
+void *
+wakefield_scratch_get(struct wakefield_scratch *scratch, size_t size)
+{
+    if (size <= scratch->size) {
+        return scratch->data;
+    }
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t new_size  = (size + page_size - 1) / page_size * page_size;
+
+    // The old contents need not be preserved, so don't bother with realloc().
+    free(scratch->data);
+    scratch->data = NULL;
+    scratch->size = 0;
+    if (posix_memalign(&scratch->data, page_size, new_size) != 0) {
+        weston_log_scope_printf(scratch->log,
+                                "WAKEFIELD: failed to grow scratch arena to %ld bytes\n", new_size);
+        scratch->data = NULL;
+        return NULL;
+    }
+
+    scratch->size = new_size;
+    scratch->reallocations++;
+    weston_log_scope_printf(scratch->log,
+                            "WAKEFIELD: scratch arena grown to %ld bytes (%u reallocation(s) so far)\n",
+                            scratch->size, scratch->reallocations);
+
+    return scratch->data;
+}
+
+void
+wakefield_scratch_done(struct wakefield_scratch *scratch)
+{
+    if (scratch->high_water_mark && scratch->size > scratch->high_water_mark) {
+        scratch_release(scratch);
+        return;
+    }
+
+    if (scratch->data) {
+        wl_event_source_timer_update(scratch->idle_timer, WAKEFIELD_SCRATCH_IDLE_RELEASE_MS);
+    }
+}
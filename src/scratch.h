@@ -0,0 +1,48 @@
+#ifndef WAKEFIELD_SCRATCH_H
+#define WAKEFIELD_SCRATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+struct weston_log_scope;
+
+/**
+ * Grow-only, page-aligned memory for temporary pixel storage that is reused
+ * by all requests instead of allocating and freeing it every time.
+ * The memory is released when the plugin has been idle for a while, and right
+ * after use if it has grown beyond the high-water mark.
+ */
+struct wakefield_scratch {
+    struct weston_log_scope *log;
+    struct wl_event_source  *idle_timer;
+
+    void     *data;
+    size_t    size;            // in bytes, a multiple of the page size
+    size_t    high_water_mark; // in bytes, 0 for no limit
+    uint32_t  reallocations;
+};
+
+bool
+wakefield_scratch_init(struct wakefield_scratch *scratch, struct wl_event_loop *loop,
+                       struct weston_log_scope *log, size_t high_water_mark);
+
+void
+wakefield_scratch_fini(struct wakefield_scratch *scratch);
+
+/**
+ * Returns at least size bytes of memory that stay valid until the next call
+ * to wakefield_scratch_get() or wakefield_scratch_done(), or NULL if out of memory.
+ */
+void *
+wakefield_scratch_get(struct wakefield_scratch *scratch, size_t size);
+
+/**
+ * Tells that the memory returned by wakefield_scratch_get() is no longer in use.
+ */
+void
+wakefield_scratch_done(struct wakefield_scratch *scratch);
+
+#endif //WAKEFIELD_SCRATCH_H
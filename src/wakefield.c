@@ -1,11 +1,25 @@
 #include <weston/weston.h>
 #include <libweston/weston-log.h>
+#include <libweston/version.h>
 
 #include <pixman.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "wakefield-server-protocol.h"
+#include "convert.h"
+#include "scratch.h"
+#include "hash.h"
+#include "compare.h"
+#include "workers.h"
+#include "encode.h"
+#include "encoder.h"
+#include "record.h"
 
 #ifndef container_of
 #define container_of(ptr, type, member) ({                              \
@@ -13,11 +27,280 @@
         (type *)( (char *)__mptr - offsetof(type,member) );})
 #endif
 
+#ifndef MIN
+#define MIN(x,y) (((x) < (y)) ? (x) : (y))
+#endif
+
+#ifndef MAX
+#define MAX(x,y) (((x) > (y)) ? (x) : (y))
+#endif
+
+#define WAKEFIELD_VERSION 2
+
 struct wakefield {
     struct weston_compositor *compositor;
     struct wl_listener destroy_listener;
+    struct wl_listener output_created_listener;
+    struct wl_listener output_destroyed_listener;
+    struct wl_listener output_moved_listener;
+
+    struct wl_list output_list;          // wakefield_output::link
+    struct wl_list pending_capture_list; // wakefield_pending_capture::link
+    struct wl_list capture_list;         // wakefield_capture::link
+    struct wl_list condition_list;       // wakefield_condition::link, only those not done yet
+    struct wl_list screencast_list;      // wakefield_screencast::link
+    struct wl_list compressed_capture_list; // wakefield_compressed_capture::link, being encoded
+    struct wl_list surface_watch_list;   // wakefield_surface_watch::link
+    struct wl_list sync_list;            // wakefield_sync::link, only those committed and not done yet
 
     struct weston_log_scope *log;
+
+    struct wakefield_scratch scratch; // temporary pixel storage shared by all requests
+    struct wakefield_workers workers; // threads that help read large captures
+    struct wakefield_encoder encoder; // the thread that encodes compressed captures
+
+    struct wakefield_record_writer recorder;    // the session being recorded, if file is not NULL
+    struct wl_protocol_logger     *request_logger;
+    struct timespec                record_start;
+
+    bool   snapshot_cache;                  // serve pixel reads from a per-output copy of the last frame
+    size_t scratch_high_water_mark;         // in bytes
+    int    threads;                         // the number of threads reading large captures, 1 and up
+    bool   scene_sampling;                  // work out single pixel colors from the views when possible
+    bool   pixman_direct;                   // read straight from the pixman renderer's output images
+    bool   repaint_step;                    // the step request hurries pending repaints
+    const char *record_path;                // record the session into this file unless NULL
+    const char *record_outputs;             // comma-separated names of outputs to record, NULL for all
+    uint32_t    record_keyframe_interval;   // record the entire output every this many frames
+};
+
+// The default size of the scratch arena above which it is released right after use.
+#define WAKEFIELD_SCRATCH_HIGH_WATER_MARK_MB 64
+
+// The largest number of threads reading captures, including the compositor thread.
+#define WAKEFIELD_MAX_THREADS 16
+
+// The deepest stack of translucent views under a pixel that scene sampling composites.
+#define WAKEFIELD_SCENE_SAMPLING_MAX_DEPTH 8
+
+// The default number of frames of an output recorded between two keyframes.
+#define WAKEFIELD_RECORD_KEYFRAME_INTERVAL 100
+
+/**
+ * A copy of the entire output image in the compositor's read_format.
+ */
+struct wakefield_snapshot {
+    void    *pixels;
+    int32_t  width;
+    int32_t  height;
+    bool     valid;  // false after the output has been repainted
+};
+
+#if WESTON_VERSION_MAJOR == 9
+/**
+ * The beginning of the pixman renderer's per-output state (struct pixman_output_state in
+ * weston 9's libweston/pixman-renderer.c), which libweston keeps private. Only looked at
+ * with --wakefield-pixman-direct when the compositor uses that renderer; other versions
+ * of weston may lay it out differently.
+ */
+struct wakefield_pixman_output_state {
+    void           *shadow_buffer;
+    pixman_image_t *shadow_image;
+    pixman_image_t *hw_buffer;    // the image of the output that read_pixels() copies from
+};
+#endif
+
+/**
+ * Per-output state of the plugin.
+ */
+struct wakefield_output {
+    struct wakefield     *wakefield;
+    struct weston_output *output;
+    struct wl_list        link;           // wakefield::output_list
+    struct wl_listener    frame_listener; // weston_output::frame_signal
+
+    struct wakefield_snapshot snapshot;
+
+    bool           recorded;              // the output has been described in the recording
+    pixman_box32_t recorded_box;          // the output's area as described in the recording
+    uint32_t       frames_since_keyframe;
+};
+
+/**
+ * An element of the points array of the get_pixel_colors request.
+ */
+struct wakefield_point {
+    int32_t x;
+    int32_t y;
+};
+
+/**
+ * An element of the colors array of the pixel_colors event.
+ */
+struct wakefield_pixel_color_result {
+    uint32_t rgb;
+    uint32_t error_code;
+};
+
+/**
+ * An element of the surfaces array of the surfaces event.
+ */
+struct wakefield_surface_info {
+    uint32_t surface;  // the object id in the calling client, 0 if it's another client's
+    int32_t  x;
+    int32_t  y;
+    int32_t  width;
+    int32_t  height;
+    uint32_t stacking; // 0 for the topmost
+    int32_t  output;   // the index from the surfaces_output events, -1 for none
+    uint32_t flags;    // from the wakefield surface_flags enum
+};
+
+// Keeps the surfaces events well below the Wayland message size limit (4096 bytes).
+#define WAKEFIELD_SURFACES_PER_EVENT 64
+
+/**
+ * A capture requested with capture_create_after_repaint that is made
+ * once all the outputs it intersects have been repainted.
+ */
+struct wakefield_pending_capture {
+    struct wakefield   *wakefield;
+    struct wl_list      link;                    // wakefield::pending_capture_list
+    struct wl_resource *resource;                // the wakefield resource that requested the capture
+    struct wl_resource *buffer_resource;
+    struct wl_listener  buffer_destroy_listener;
+    int32_t             x;
+    int32_t             y;
+    uint32_t            output_mask;             // bits of weston_output::id yet to be repainted
+};
+
+/**
+ * A persistent capture of a fixed screen area into the same buffer that only
+ * re-reads the parts of the area that were repainted since the last update.
+ */
+struct wakefield_capture {
+    struct wakefield   *wakefield;
+    struct wl_resource *resource;                // wakefield_capture
+    struct wl_list      link;                    // wakefield::capture_list
+    struct wl_resource *buffer_resource;         // NULL once the buffer has been destroyed
+    struct wl_listener  buffer_destroy_listener;
+    int32_t             x;
+    int32_t             y;
+    int32_t             width;
+    int32_t             height;
+    pixman_region32_t   damage;                  // global coordinates, yet to be re-read
+};
+
+/**
+ * A condition registered with wait_for_color that is re-checked after every
+ * repaint that touches its area until it holds or times out.
+ */
+struct wakefield_condition {
+    struct wakefield       *wakefield;
+    struct wl_resource     *resource;  // wakefield_condition
+    struct wl_list          link;      // wakefield::condition_list
+    struct wl_event_source *timer;     // NULL if there's no timeout
+    int32_t                 x;
+    int32_t                 y;
+    int32_t                 width;
+    int32_t                 height;
+    uint32_t                rgb;
+    uint32_t                tolerance; // the largest difference allowed in each color channel
+    bool                    done;
+};
+
+/**
+ * A screencast that fills the buffers queued by the client with the contents
+ * of its area after every repaint that touches the area.
+ */
+struct wakefield_screencast {
+    struct wakefield       *wakefield;
+    struct wl_resource     *resource;        // wakefield_screencast
+    struct wl_list          link;            // wakefield::screencast_list
+    struct wl_list          buffer_list;     // wakefield_screencast_buffer::link, in the order of queueing
+    struct wl_event_source *timer;           // fires when the frame rate limit allows the next frame
+    int32_t                 x;
+    int32_t                 y;
+    int32_t                 width;           // 0 until the first buffer is queued
+    int32_t                 height;
+    uint32_t                format;          // wl_shm format of the buffers
+    uint32_t                frame_interval;  // in milliseconds, 0 for no limit
+    struct timespec         frame_time;      // when the last frame was sent
+    uint32_t                sequence;        // the number of repaints that touched the area
+    struct timespec         sequence_time;   // when the last repaint of the area was rendered (not shown)
+    bool                    dirty;           // the area was repainted after the last frame was sent
+};
+
+/**
+ * A batch of surface moves that are applied together when the layout is committed.
+ */
+struct wakefield_layout {
+    struct wakefield   *wakefield;
+    struct wl_resource *resource;  // wakefield_layout
+    struct wl_list      move_list; // wakefield_layout_move::link, in the order of requests
+};
+
+/**
+ * A surface move waiting for its layout to be committed.
+ */
+struct wakefield_layout_move {
+    struct wl_list      link;                     // wakefield_layout::move_list
+    struct wl_resource *surface_resource;
+    struct wl_listener  surface_destroy_listener;
+    int32_t             x;
+    int32_t             y;
+};
+
+/**
+ * A subscription to changes of a surface's location, size and output that are
+ * checked after every repaint.
+ */
+struct wakefield_surface_watch {
+    struct wakefield     *wakefield;
+    struct wl_resource   *resource;                 // wakefield_surface_watch
+    struct wl_list        link;                     // wakefield::surface_watch_list
+    struct wl_resource   *surface_resource;         // NULL once the surface has been destroyed
+    struct wl_listener    surface_destroy_listener;
+    bool                  mapped;                   // the state last sent
+    int32_t               x;
+    int32_t               y;
+    int32_t               width;
+    int32_t               height;
+    struct weston_output *output;                   // only compared, may be gone
+};
+
+/**
+ * A barrier that is done once the outputs that had a repaint pending
+ * when it was committed have been repainted.
+ */
+struct wakefield_sync {
+    struct wakefield   *wakefield;
+    struct wl_resource *resource;            // wakefield_sync
+    struct wl_list      link;                // wakefield::sync_list
+    bool                surfaces_added;
+    uint32_t            surface_output_mask; // bits of weston_output::id showing the added surfaces
+    bool                committed;
+    uint32_t            output_mask;         // bits of weston_output::id yet to be repainted
+};
+
+/**
+ * A capture_compressed request whose image is being encoded in the background.
+ */
+struct wakefield_compressed_capture {
+    struct wakefield_encode_job job;
+    struct wl_list              link;     // wakefield::compressed_capture_list
+    struct wl_resource         *resource; // wakefield, NULL once destroyed
+    uint32_t                    serial;
+};
+
+/**
+ * A buffer queued with a screencast and not yet handed back.
+ */
+struct wakefield_screencast_buffer {
+    struct wakefield_screencast *screencast;
+    struct wl_list               link;     // wakefield_screencast::buffer_list
+    struct wl_resource          *resource; // wl_buffer
+    struct wl_listener           destroy_listener;
 };
 
 static struct weston_output*
@@ -36,446 +319,3846 @@ get_output_for_point(struct wakefield* wakefield, int32_t x, int32_t y)
     return NULL;
 }
 
-static void
-wakefield_get_pixel_color(struct wl_client *client,
-                          struct wl_resource *resource,
-                          int32_t x,
-                          int32_t y)
+static struct wakefield_output*
+get_wakefield_output(struct wakefield *wakefield, struct weston_output *output)
 {
-    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct wakefield_output *wo;
+    wl_list_for_each(wo, &wakefield->output_list, link) {
+        if (wo->output == output) {
+            return wo;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns true iff pixels in the format a can be copied byte-for-byte to get pixels in the format b.
+ * The formats may only differ in the presence of the alpha channel.
+ */
+static bool
+pixman_formats_compatible(pixman_format_code_t a, pixman_format_code_t b)
+{
+    return a == b
+           || (PIXMAN_FORMAT_BPP(a) == PIXMAN_FORMAT_BPP(b)
+               && PIXMAN_FORMAT_TYPE(a) == PIXMAN_FORMAT_TYPE(b)
+               && PIXMAN_FORMAT_RGB(a) == PIXMAN_FORMAT_RGB(b));
+}
+
+/**
+ * Makes sure the snapshot of the given output contains the output's current image.
+ *
+ * @return false iff the snapshot could not be taken.
+ */
+static bool
+refresh_snapshot(struct wakefield_output *wo)
+{
+    struct wakefield *wakefield = wo->wakefield;
     struct weston_compositor *compositor = wakefield->compositor;
+    struct weston_output *output = wo->output;
+    struct wakefield_snapshot *snapshot = &wo->snapshot;
 
-    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_pixel_color at (%d, %d)\n", x, y);
+    if (snapshot->valid
+        && snapshot->width == output->width && snapshot->height == output->height) {
+        return true;
+    }
 
-    const unsigned int byte_per_pixel = (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-    uint32_t pixel = 0;
-    if (byte_per_pixel > sizeof(pixel)) {
+    const size_t byte_per_pixel = PIXMAN_FORMAT_BPP(compositor->read_format) / 8;
+    if (snapshot->width != output->width || snapshot->height != output->height) {
+        free(snapshot->pixels);
+        snapshot->width  = output->width;
+        snapshot->height = output->height;
+        snapshot->pixels = malloc((size_t)snapshot->width * snapshot->height * byte_per_pixel);
+    }
+
+    snapshot->valid = false;
+    if (snapshot->pixels == NULL) {
         weston_log_scope_printf(wakefield->log,
-                                "WAKEFIELD: compositor pixel format (%d) exceeds allocated storage (%d > %ld)\n",
-                                compositor->read_format,
-                                byte_per_pixel,
-                                sizeof(pixel));
-        wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_FORMAT);
-        return;
+                                "WAKEFIELD: failed to allocate snapshot of '%s'\n", output->name);
+        snapshot->width  = 0;
+        snapshot->height = 0;
+        return false;
     }
 
-    struct weston_output *output = get_output_for_point(wakefield, x, y);
-    if (output == NULL) {
+    if (compositor->renderer->read_pixels(output, compositor->read_format, snapshot->pixels,
+                                          0, 0, snapshot->width, snapshot->height) < 0) {
         weston_log_scope_printf(wakefield->log,
-                                "WAKEFIELD: pixel location (%d, %d) doesn't map to any output\n", x, y);
-        wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_INVALID_COORDINATES);
-        return;
+                                "WAKEFIELD: failed to read pixels of '%s' into snapshot\n", output->name);
+        return false;
     }
-    
-    const int output_x = x - output->x;
-    const int output_y = y - output->y;
+
     weston_log_scope_printf(wakefield->log,
-                            "WAKEFIELD: reading pixel color at (%d, %d) of '%s'\n",
-                            output_x, output_y, output->name);
-    compositor->renderer->read_pixels(output,
-                                      compositor->read_format, &pixel,
-                                      output_x, output_y, 1, 1);
+                            "WAKEFIELD: took snapshot of '%s' sized (%d, %d)\n",
+                            output->name, snapshot->width, snapshot->height);
+    snapshot->valid = true;
+    return true;
+}
 
-    uint32_t rgb = 0;
-    switch (compositor->read_format) {
-        case PIXMAN_a8r8g8b8:
-        case PIXMAN_x8r8g8b8:
-        case PIXMAN_r8g8b8:
-            rgb = pixel & 0x00ffffffu;
-            break;
+/**
+ * Returns the pixman renderer's image of the given output if direct access to it
+ * is enabled and the image contains the given rectangle, NULL otherwise.
+ */
+static pixman_image_t *
+get_output_image(struct wakefield *wakefield, struct weston_output *output,
+                 int32_t x, int32_t y, int32_t width, int32_t height)
+{
+#if WESTON_VERSION_MAJOR != 9
+    return NULL;
+#else
+    if (!wakefield->pixman_direct || output->renderer_state == NULL)
+        return NULL;
 
-        default:
-            weston_log_scope_printf(wakefield->log,
-                                    "WAKEFIELD: compositor pixel format %d (see pixman.h) not supported\n",
-                                    compositor->read_format);
-            wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_FORMAT);
-            return;
-    }
-    weston_log_scope_printf(wakefield->log, "WAKEFIELD: color is 0x%08x\n", rgb);
+    const struct wakefield_pixman_output_state *state = output->renderer_state;
+    pixman_image_t *image = state->hw_buffer;
+    if (image == NULL || x < 0 || y < 0
+        || x + width > pixman_image_get_width(image) || y + height > pixman_image_get_height(image))
+        return NULL;
 
-    wakefield_send_pixel_color(resource, x, y, rgb, WAKEFIELD_ERROR_NO_ERROR);
+    return image;
+#endif
 }
 
-static void
-wakefield_get_surface_location(struct wl_client *client,
-                               struct wl_resource *resource,
-                               struct wl_resource *surface_resource)
+/**
+ * Converts a rectangle of pixels of the given output to the given wl_shm format straight from
+ * the pixman renderer's image of the output into memory where rows are the given number of bytes apart.
+ *
+ * @return 0 on success, -1 if there's no direct access to the output's image
+ *         or its pixels can't be converted to the given format.
+ */
+static int
+convert_output_pixels_directly(struct wakefield *wakefield, struct weston_output *output,
+                               uint32_t shm_format, void *pixels, size_t stride,
+                               int32_t x, int32_t y, int32_t width, int32_t height)
 {
-    // See also weston-test.c`move_surface() and the corresponding protocol
+    pixman_image_t *image = get_output_image(wakefield, output, x, y, width, height);
+    if (image == NULL)
+        return -1;
 
-    struct wakefield *wakefield = wl_resource_get_user_data(resource);
-    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
-    struct weston_view *view = container_of(surface->views.next, struct weston_view, surface_link);
+    const pixman_format_code_t format = pixman_image_get_format(image);
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(format, shm_format);
+    if (convert == NULL)
+        return -1;
 
-    if (!view) {
-        weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_location error\n");
-        wakefield_send_surface_location(resource, surface_resource, 0, 0,
-                                        WAKEFIELD_ERROR_INTERNAL);
-        return;
+    const size_t src_stride = pixman_image_get_stride(image);
+    const uint8_t *src = (uint8_t *)pixman_image_get_data(image) + y*src_stride + x*(PIXMAN_FORMAT_BPP(format) / 8);
+    uint8_t       *dst = pixels;
+    for (int32_t row = 0; row < height; row++) {
+        convert(dst, src, width);
+        src += src_stride;
+        dst += stride;
     }
 
-    float fx;
-    float fy;
-    weston_view_to_global_float(view, 0, 0, &fx, &fy);
-    const int32_t x = (int32_t)fx;
-    const int32_t y = (int32_t)fy;
-    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_location: %d, %d\n", x, y);
-
-    wakefield_send_surface_location(resource, surface_resource, x, y,
-                                    WAKEFIELD_ERROR_NO_ERROR);
+    return 0;
 }
 
-static void
-wakefield_move_surface(struct wl_client *client,
-                       struct wl_resource *resource,
-                       struct wl_resource *surface_resource,
-                       int32_t x,
-                       int32_t y)
+/**
+ * Reads a rectangle of pixels of the given output into memory where rows are
+ * the given number of bytes apart. Uses the snapshot of the output if it is enabled
+ * and suitable for the given format; otherwise resorts to the renderer's read_pixels(),
+ * which can only produce contiguous rows.
+ *
+ * @return 0 on success, -1 if the pixels could not be read, in particular,
+ *         with the given stride.
+ */
+static int
+read_output_pixels_strided(struct wakefield *wakefield, struct weston_output *output,
+                           pixman_format_code_t format, void *pixels, size_t stride,
+                           int32_t x, int32_t y, int32_t width, int32_t height)
 {
-    struct wakefield *wakefield = wl_resource_get_user_data(resource);
-    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
-    struct weston_view *view = container_of(surface->views.next, struct weston_view, surface_link);
+    struct weston_compositor *compositor = wakefield->compositor;
+    struct wakefield_output *wo = get_wakefield_output(wakefield, output);
+    const size_t byte_per_pixel = PIXMAN_FORMAT_BPP(format) / 8;
+    const size_t row_size       = width * byte_per_pixel;
 
-    if (!view) {
-        weston_log_scope_printf(wakefield->log, "WAKEFIELD: move_surface error\n");
-        return;
+    pixman_image_t *image = get_output_image(wakefield, output, x, y, width, height);
+    if (image && pixman_formats_compatible(pixman_image_get_format(image), format)) {
+        const size_t src_stride = pixman_image_get_stride(image);
+        const uint8_t *src = (uint8_t *)pixman_image_get_data(image) + y*src_stride + x*byte_per_pixel;
+        uint8_t       *dst = pixels;
+        for (int32_t row = 0; row < height; row++) {
+            memcpy(dst, src, row_size);
+            src += src_stride;
+            dst += stride;
+        }
+        return 0;
     }
 
-    weston_view_set_position(view, (float)x, (float)y);
-    weston_view_update_transform(view);
+    if (wakefield->snapshot_cache && wo
+        && pixman_formats_compatible(compositor->read_format, format)
+        && refresh_snapshot(wo)
+        && x >= 0 && y >= 0 && x + width <= wo->snapshot.width && y + height <= wo->snapshot.height) {
+        const size_t src_stride = wo->snapshot.width * byte_per_pixel;
+        const uint8_t *src = (uint8_t *)wo->snapshot.pixels + y*src_stride + x*byte_per_pixel;
+        uint8_t       *dst = pixels;
+        for (int32_t row = 0; row < height; row++) {
+            memcpy(dst, src, row_size);
+            src += src_stride;
+            dst += stride;
+        }
+        return 0;
+    }
 
-    weston_log_scope_printf(wakefield->log, "WAKEFIELD: move_surface to (%d, %d)\n", x, y);
+    if (stride != row_size && height > 1) {
+        return -1;
+    }
+
+    return compositor->renderer->read_pixels(output, format, pixels, x, y, width, height);
 }
 
-static pixman_format_code_t
-wl_shm_format_to_pixman(uint32_t wl_shm_format)
+/**
+ * Reads a rectangle of pixels of the given output just like the renderer's read_pixels(),
+ * but uses the snapshot of the output if it is enabled and suitable for the given format.
+ */
+static int
+read_output_pixels(struct wakefield *wakefield, struct weston_output *output,
+                   pixman_format_code_t format, void *pixels,
+                   int32_t x, int32_t y, int32_t width, int32_t height)
 {
-    pixman_format_code_t rc;
+    const size_t stride = width * (PIXMAN_FORMAT_BPP(format) / 8);
+    return read_output_pixels_strided(wakefield, output, format, pixels, stride, x, y, width, height);
+}
 
-    switch (wl_shm_format) {
-        case WL_SHM_FORMAT_ARGB8888:
-            rc = PIXMAN_a8r8g8b8;
-            break;
-        case WL_SHM_FORMAT_XRGB8888:
-            rc = PIXMAN_x8r8g8b8;
-            break;
-        default:
-            assert(false);
+/**
+ * Converts a pixel in the compositor's read_format to the 24-bit r8g8b8 color.
+ *
+ * @return false iff the compositor's read_format is not supported.
+ */
+static bool
+pixel_to_rgb(struct wakefield *wakefield, uint32_t pixel, uint32_t *rgb)
+{
+    const pixman_format_code_t read_format = wakefield->compositor->read_format;
+    if (read_format == PIXMAN_r8g8b8) {
+        *rgb = pixel & 0x00ffffffu;
+        return true;
+    }
+
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(read_format,
+                                                                                WL_SHM_FORMAT_XRGB8888);
+    if (convert == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: compositor pixel format %d (see pixman.h) not supported\n",
+                                read_format);
+        return false;
     }
 
-    return rc;
+    convert(rgb, &pixel, 1);
+    *rgb &= 0x00ffffffu;
+    return true;
 }
 
 /**
- * Returns the number of pixels in the given non-empty region.
+ * Multiplies two 8-bit color components exactly like pixman does.
  */
-static uint64_t
-size_in_pixels(pixman_region32_t *region)
+static inline uint32_t
+mul_un8(uint32_t a, uint32_t b)
 {
-    const pixman_box32_t * const e = pixman_region32_extents(region);
-    assert (e->x2 >= e->x1);
-    assert (e->y2 >= e->y1);
+    const uint32_t t = a * b + 0x80;
+    return ((t >> 8) + t) >> 8;
+}
 
-    return ((uint64_t)(e->x2 - e->x1))*(e->y2 - e->y1);
+/**
+ * Reads the pixel of the view at the given global coordinates straight from its surface's contents.
+ *
+ * @param pixel (OUT) the premultiplied a8r8g8b8 color
+ * @return false if the view's contents don't map onto the screen 1:1 because of a transform,
+ *         a buffer scale or viewport, or translucency of the entire view, or if the surface has
+ *         changes that have not been repainted yet.
+ */
+static bool
+sample_view(struct weston_view *view, int32_t x, int32_t y, uint32_t *pixel)
+{
+    struct weston_surface *surface = view->surface;
+    const struct weston_buffer_viewport *viewport = &surface->buffer_viewport;
+
+    if (view->transform.enabled || view->transform.dirty || view->alpha != 1.0f
+        || viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL || viewport->buffer.scale != 1
+        || viewport->buffer.src_width != wl_fixed_from_int(-1) || viewport->surface.width != -1
+        || pixman_region32_not_empty(&surface->damage))
+        return false;
+
+    int32_t sx;
+    int32_t sy;
+    int width;
+    int height;
+    weston_view_from_global(view, x, y, &sx, &sy);
+    weston_surface_get_content_size(surface, &width, &height);
+    if (sx < 0 || sy < 0 || sx >= width || sy >= height)
+        return false;
+
+    // The renderer hands out premultiplied RGBA in memory order.
+    uint8_t rgba[4];
+    if (weston_surface_copy_content(surface, rgba, sizeof(rgba), sx, sy, 1, 1) < 0)
+        return false;
+
+    *pixel = (uint32_t)rgba[3] << 24 | (uint32_t)rgba[0] << 16 | (uint32_t)rgba[1] << 8 | rgba[2];
+    return true;
 }
 
 /**
- * Get the number of pixels of the largest portion that the given region occupies on
- * any of the compositor's outputs.
+ * Works out the color of the pixel at the given global coordinates from the contents of
+ * the views that cover it, compositing them the way the pixman renderer does, instead
+ * of reading the pixel back from the output.
  *
- * @param fits_entirely (OUT) set to true iff the entire region fits as a whole on just one output
- * @return largest area size in pixels (could be zero).
+ * @return false if that can't be done reliably and the pixel has to be read from the output.
  */
-static uint64_t
-get_largest_area_in_one_output(struct weston_compositor *compositor, pixman_region32_t *region, bool *fits_entirely)
+static bool
+sample_scene(struct wakefield *wakefield, int32_t x, int32_t y, uint32_t *rgb)
 {
-    uint64_t area = 0; // in pixels
-    *fits_entirely = false;
+    struct weston_compositor *compositor = wakefield->compositor;
 
-    pixman_region32_t region_in_output;
-    pixman_region32_init(&region_in_output);
+    if (!pixman_formats_compatible(compositor->read_format, PIXMAN_x8r8g8b8))
+        return false; // the renderer would lose precision
 
-    struct weston_output *output;
-    wl_list_for_each(output, &compositor->output_list, link) {
-        if (output->destroying)
+    // Collect the pixels from the top down to the first opaque one.
+    uint32_t pixels[WAKEFIELD_SCENE_SAMPLING_MAX_DEPTH];
+    int  depth  = 0;
+    bool opaque = false;
+    struct weston_view *view;
+    wl_list_for_each(view, &compositor->view_list, link) {
+        if (!pixman_region32_contains_point(&view->transform.boundingbox, x, y, NULL))
             continue;
 
-        pixman_region32_intersect(&region_in_output, region, &output->region);
-        if (pixman_region32_not_empty(&region_in_output)) {
-            const uint64_t this_area = size_in_pixels(&region_in_output);
+        if (depth == WAKEFIELD_SCENE_SAMPLING_MAX_DEPTH || !sample_view(view, x, y, &pixels[depth]))
+            return false;
+
+        // The renderer ignores the alpha channel within the opaque region of a surface.
+        opaque = (pixels[depth] >> 24) == 0xff
+                 || pixman_region32_contains_point(&view->transform.opaque, x, y, NULL);
+        depth++;
+        if (opaque)
+            break;
+    }
+
+    if (!opaque)
+        return false; // what shows through is up to the renderer
+
+    // Composite them from the bottom up with the OVER operator.
+    uint32_t color = pixels[depth - 1];
+    for (int i = depth - 2; i >= 0; i--) {
+        const uint32_t inverse_alpha = 0xff - (pixels[i] >> 24);
+        uint32_t result = 0;
+        for (int shift = 0; shift < 24; shift += 8) {
+            const uint32_t c = ((pixels[i] >> shift) & 0xff) + mul_un8((color >> shift) & 0xff, inverse_alpha);
+            result |= MIN(c, 0xffu) << shift;
+        }
+        color = result;
+    }
+
+    *rgb = color & 0x00ffffffu;
+    return true;
+}
+
+static void
+wakefield_get_pixel_color(struct wl_client *client,
+                          struct wl_resource *resource,
+                          int32_t x,
+                          int32_t y)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_compositor *compositor = wakefield->compositor;
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_pixel_color at (%d, %d)\n", x, y);
+
+    const unsigned int byte_per_pixel = (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+    uint32_t pixel = 0;
+    if (byte_per_pixel > sizeof(pixel)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: compositor pixel format (%d) exceeds allocated storage (%d > %ld)\n",
+                                compositor->read_format,
+                                byte_per_pixel,
+                                sizeof(pixel));
+        wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+
+    struct weston_output *output = get_output_for_point(wakefield, x, y);
+    if (output == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: pixel location (%d, %d) doesn't map to any output\n", x, y);
+        wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+    
+    uint32_t rgb = 0;
+    if (wakefield->scene_sampling && sample_scene(wakefield, x, y, &rgb)) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: color sampled from the scene is 0x%08x\n", rgb);
+        wakefield_send_pixel_color(resource, x, y, rgb, WAKEFIELD_ERROR_NO_ERROR);
+        return;
+    }
+
+    const int output_x = x - output->x;
+    const int output_y = y - output->y;
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: reading pixel color at (%d, %d) of '%s'\n",
+                            output_x, output_y, output->name);
+    read_output_pixels(wakefield, output,
+                       compositor->read_format, &pixel,
+                       output_x, output_y, 1, 1);
+
+    if (!pixel_to_rgb(wakefield, pixel, &rgb)) {
+        wakefield_send_pixel_color(resource, x, y, 0, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: color is 0x%08x\n", rgb);
+
+    wakefield_send_pixel_color(resource, x, y, rgb, WAKEFIELD_ERROR_NO_ERROR);
+}
+
+/**
+ * Marks all the points as having the given error code.
+ */
+static void
+set_pixel_colors_error(struct wl_array *colors, uint32_t error_code)
+{
+    struct wakefield_pixel_color_result *c;
+    wl_array_for_each(c, colors) {
+        c->rgb = 0;
+        c->error_code = error_code;
+    }
+}
+
+// get_pixel_colors reads every point separately once the bounding box of the points on an output
+// has this many times as many pixels as there are points.
+#define WAKEFIELD_PIXEL_COLORS_SPARSE_FACTOR 64
+
+/**
+ * Reads the colors of those of the given points that the given output contains
+ * and that haven't been read yet (marked with WAKEFIELD_ERROR_INVALID_COORDINATES).
+ * The pixels are obtained with one read of the bounding box of all such points,
+ * unless that box is mostly empty, in which case they are read one at a time.
+ */
+static void
+read_pixel_colors_in_output(struct wakefield *wakefield, struct weston_output *output,
+                            const struct wakefield_point *points, struct wakefield_pixel_color_result *colors,
+                            size_t count)
+{
+    struct weston_compositor *compositor = wakefield->compositor;
+
+    pixman_box32_t box = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+    size_t points_in_output = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (colors[i].error_code != WAKEFIELD_ERROR_INVALID_COORDINATES
+            || !pixman_region32_contains_point(&output->region, points[i].x, points[i].y, NULL))
+            continue;
+
+        if (points[i].x < box.x1) box.x1 = points[i].x;
+        if (points[i].y < box.y1) box.y1 = points[i].y;
+        if (points[i].x >= box.x2) box.x2 = points[i].x + 1;
+        if (points[i].y >= box.y2) box.y2 = points[i].y + 1;
+        points_in_output++;
+    }
+
+    if (points_in_output == 0)
+        return;
+
+    const int32_t box_width  = box.x2 - box.x1;
+    const int32_t box_height = box.y2 - box.y1;
+    const unsigned int byte_per_pixel = (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+
+    if ((uint64_t)box_width * box_height > (uint64_t)points_in_output * WAKEFIELD_PIXEL_COLORS_SPARSE_FACTOR) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: reading %ld scattered pixel(s) of '%s' one by one\n",
+                                points_in_output, output->name);
+
+        for (size_t i = 0; i < count; i++) {
+            if (colors[i].error_code != WAKEFIELD_ERROR_INVALID_COORDINATES
+                || !pixman_region32_contains_point(&output->region, points[i].x, points[i].y, NULL))
+                continue;
+
+            uint32_t pixel = 0;
+            if (read_output_pixels(wakefield, output, compositor->read_format, &pixel,
+                                   points[i].x - output->x, points[i].y - output->y, 1, 1) < 0) {
+                colors[i].error_code = WAKEFIELD_ERROR_INTERNAL;
+            } else {
+                colors[i].error_code = WAKEFIELD_ERROR_NO_ERROR;
+                pixel_to_rgb(wakefield, pixel, &colors[i].rgb); // the format has been verified by the caller
+            }
+        }
+        return;
+    }
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: reading %ld pixel(s) from the box at (%d, %d) sized (%d, %d) of '%s'\n",
+                            points_in_output, box.x1, box.y1, box_width, box_height, output->name);
+
+    uint8_t *pixels = wakefield_scratch_get(&wakefield->scratch, (size_t)box_width * box_height * byte_per_pixel);
+    if (pixels == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: failed to allocate %ld bytes for pixel colors.\n",
+                                (size_t)box_width * box_height * byte_per_pixel);
+        error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+    } else if (read_output_pixels(wakefield, output,
+                                  compositor->read_format, pixels,
+                                  box.x1 - output->x, box.y1 - output->y,
+                                  box_width, box_height) < 0) {
+        error_code = WAKEFIELD_ERROR_INTERNAL;
+        pixels = NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (colors[i].error_code != WAKEFIELD_ERROR_INVALID_COORDINATES
+            || !pixman_region32_contains_point(&output->region, points[i].x, points[i].y, NULL))
+            continue;
+
+        colors[i].error_code = error_code;
+        if (pixels) {
+            const size_t offset = ((size_t)(points[i].y - box.y1)*box_width + (points[i].x - box.x1))*byte_per_pixel;
+            uint32_t pixel = 0;
+            memcpy(&pixel, &pixels[offset], byte_per_pixel);
+            pixel_to_rgb(wakefield, pixel, &colors[i].rgb); // the format has been verified by the caller
+        }
+    }
+
+}
+
+static void
+wakefield_get_pixel_colors(struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_array *points_array)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_compositor *compositor = wakefield->compositor;
+
+    const size_t count = points_array->size / sizeof(struct wakefield_point);
+    const struct wakefield_point * const points = points_array->data;
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_pixel_colors for %ld point(s)\n", count);
+
+    struct wl_array colors;
+    wl_array_init(&colors);
+    struct wakefield_pixel_color_result *results = wl_array_add(&colors, count * sizeof(*results));
+    if (count > 0 && results == NULL) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: failed to allocate pixel colors reply\n");
+        wl_resource_post_no_memory(resource);
+        return;
+    }
+
+    // Every point stays "invalid" until an output that contains it is found.
+    set_pixel_colors_error(&colors, WAKEFIELD_ERROR_INVALID_COORDINATES);
+
+    // Converting a dummy pixel verifies that the compositor's format is supported at all.
+    uint32_t pixel = 0;
+    uint32_t rgb = 0;
+    if (PIXMAN_FORMAT_BPP(compositor->read_format) / 8 > sizeof(pixel)
+        || !pixel_to_rgb(wakefield, pixel, &rgb)) {
+        set_pixel_colors_error(&colors, WAKEFIELD_ERROR_FORMAT);
+    } else {
+        struct weston_output *output;
+        wl_list_for_each(output, &compositor->output_list, link) {
+            if (output->destroying)
+                continue;
+
+            read_pixel_colors_in_output(wakefield, output, points, results, count);
+        }
+    }
+
+    wakefield_scratch_done(&wakefield->scratch);
+
+    wakefield_send_pixel_colors(resource, &colors);
+    wl_array_release(&colors);
+}
+
+static void
+wakefield_get_surface_location(struct wl_client *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *surface_resource)
+{
+    // See also weston-test.c`move_surface() and the corresponding protocol
+
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
+    struct weston_view *view = container_of(surface->views.next, struct weston_view, surface_link);
+
+    if (!view) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_location error\n");
+        wakefield_send_surface_location(resource, surface_resource, 0, 0,
+                                        WAKEFIELD_ERROR_INTERNAL);
+        return;
+    }
+
+    float fx;
+    float fy;
+    weston_view_to_global_float(view, 0, 0, &fx, &fy);
+    const int32_t x = (int32_t)fx;
+    const int32_t y = (int32_t)fy;
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_location: %d, %d\n", x, y);
+
+    wakefield_send_surface_location(resource, surface_resource, x, y,
+                                    WAKEFIELD_ERROR_NO_ERROR);
+}
+
+static void
+wakefield_move_surface(struct wl_client *client,
+                       struct wl_resource *resource,
+                       struct wl_resource *surface_resource,
+                       int32_t x,
+                       int32_t y)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
+    struct weston_view *view = container_of(surface->views.next, struct weston_view, surface_link);
+
+    if (!view) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: move_surface error\n");
+        return;
+    }
+
+    weston_view_set_position(view, (float)x, (float)y);
+    weston_view_update_transform(view);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: move_surface to (%d, %d)\n", x, y);
+}
+
+/**
+ * Returns the view of the given surface or NULL if the surface is not mapped.
+ */
+static struct weston_view *
+get_surface_view(struct weston_surface *surface)
+{
+    if (wl_list_empty(&surface->views))
+        return NULL;
+
+    return container_of(surface->views.next, struct weston_view, surface_link);
+}
+
+static void
+layout_move_destroy(struct wakefield_layout_move *move)
+{
+    wl_list_remove(&move->surface_destroy_listener.link);
+    wl_list_remove(&move->link);
+    free(move);
+}
+
+static void
+layout_move_surface_destroyed(struct wl_listener *listener, void *data)
+{
+    struct wakefield_layout_move *move = container_of(listener, struct wakefield_layout_move,
+                                                      surface_destroy_listener);
+    layout_move_destroy(move);
+}
+
+static void
+layout_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void
+layout_handle_move_surface(struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_resource *surface_resource,
+                           int32_t x,
+                           int32_t y)
+{
+    struct wakefield_layout *layout = wl_resource_get_user_data(resource);
+
+    struct wakefield_layout_move *move;
+    wl_list_for_each(move, &layout->move_list, link) {
+        if (move->surface_resource == surface_resource) {
+            move->x = x;
+            move->y = y;
+            return;
+        }
+    }
+
+    move = zalloc(sizeof(struct wakefield_layout_move));
+    if (move == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    move->surface_resource = surface_resource;
+    move->x                = x;
+    move->y                = y;
+    move->surface_destroy_listener.notify = layout_move_surface_destroyed;
+    wl_resource_add_destroy_listener(surface_resource, &move->surface_destroy_listener);
+    wl_list_insert(layout->move_list.prev, &move->link);
+}
+
+static void
+layout_handle_commit(struct wl_client *client, struct wl_resource *resource, uint32_t serial)
+{
+    struct wakefield_layout *layout = wl_resource_get_user_data(resource);
+    struct wakefield *wakefield = layout->wakefield;
+
+    // All the surfaces are put in place before any transform is recomputed; nothing is repainted
+    // until this request returns, so the next frame shows the entire layout.
+    struct wakefield_layout_move *move, *tmp;
+    wl_list_for_each(move, &layout->move_list, link) {
+        struct weston_view *view = get_surface_view(wl_resource_get_user_data(move->surface_resource));
+        if (view) {
+            weston_view_set_position(view, (float)move->x, (float)move->y);
+        }
+    }
+
+    uint32_t moved = 0;
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    wl_list_for_each_safe(move, tmp, &layout->move_list, link) {
+        struct weston_view *view = get_surface_view(wl_resource_get_user_data(move->surface_resource));
+        if (view) {
+            weston_view_update_transform(view);
+            moved++;
+        } else {
+            error_code = WAKEFIELD_ERROR_INTERNAL;
+        }
+        layout_move_destroy(move);
+    }
+
+    if (moved > 0) {
+        weston_compositor_schedule_repaint(wakefield->compositor);
+    }
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: layout %d moved %d surface(s)%s\n",
+                            serial, moved, error_code ? ", some not mapped" : "");
+
+    wakefield_layout_send_done(resource, serial, moved, error_code);
+}
+
+static const struct wakefield_layout_interface wakefield_layout_implementation = {
+        .destroy = layout_handle_destroy,
+        .move_surface = layout_handle_move_surface,
+        .commit = layout_handle_commit
+};
+
+static void
+layout_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_layout *layout = wl_resource_get_user_data(resource);
+
+    struct wakefield_layout_move *move, *tmp;
+    wl_list_for_each_safe(move, tmp, &layout->move_list, link) {
+        layout_move_destroy(move);
+    }
+    free(layout);
+}
+
+static void
+wakefield_create_layout(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_layout *layout = zalloc(sizeof(struct wakefield_layout));
+    if (layout == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    layout->resource = wl_resource_create(client, &wakefield_layout_interface,
+                                          wl_resource_get_version(resource), id);
+    if (layout->resource == NULL) {
+        free(layout);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    layout->wakefield = wakefield;
+    wl_list_init(&layout->move_list);
+    wl_resource_set_implementation(layout->resource, &wakefield_layout_implementation,
+                                   layout, layout_resource_destroy);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: created layout\n");
+}
+
+/**
+ * Sends the geometry event if the surface has changed since the last one or if forced to.
+ */
+static void
+surface_watch_check(struct wakefield_surface_watch *watch, bool force)
+{
+    struct weston_view *view = watch->surface_resource
+                               ? get_surface_view(wl_resource_get_user_data(watch->surface_resource))
+                               : NULL;
+    const bool mapped = view && view->is_mapped;
+
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width  = 0;
+    int32_t height = 0;
+    struct weston_output *output = NULL;
+    if (mapped) {
+        float fx;
+        float fy;
+        weston_view_to_global_float(view, 0, 0, &fx, &fy);
+        x      = (int32_t)fx;
+        y      = (int32_t)fy;
+        width  = view->surface->width;
+        height = view->surface->height;
+        output = view->output;
+    }
+
+    if (!force && mapped == watch->mapped && x == watch->x && y == watch->y
+        && width == watch->width && height == watch->height && output == watch->output)
+        return;
+
+    watch->mapped = mapped;
+    watch->x      = x;
+    watch->y      = y;
+    watch->width  = width;
+    watch->height = height;
+    watch->output = output;
+
+    wakefield_surface_watch_send_geometry(watch->resource, x, y, width, height,
+                                          output ? output->name : "",
+                                          mapped ? WAKEFIELD_ERROR_NO_ERROR : WAKEFIELD_ERROR_INTERNAL);
+}
+
+/**
+ * Sends the geometry events for the watched surfaces that have changed.
+ */
+static void
+check_surface_watches(struct wakefield *wakefield)
+{
+    struct wakefield_surface_watch *watch;
+    wl_list_for_each(watch, &wakefield->surface_watch_list, link) {
+        if (watch->surface_resource) {
+            surface_watch_check(watch, false);
+        }
+    }
+}
+
+static void
+surface_watch_surface_destroyed(struct wl_listener *listener, void *data)
+{
+    struct wakefield_surface_watch *watch = container_of(listener, struct wakefield_surface_watch,
+                                                         surface_destroy_listener);
+
+    wl_list_remove(&watch->surface_destroy_listener.link);
+    watch->surface_resource = NULL;
+    surface_watch_check(watch, true);
+}
+
+static void
+surface_watch_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct wakefield_surface_watch_interface wakefield_surface_watch_implementation = {
+        .destroy = surface_watch_handle_destroy
+};
+
+static void
+surface_watch_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_surface_watch *watch = wl_resource_get_user_data(resource);
+
+    if (watch->surface_resource) {
+        wl_list_remove(&watch->surface_destroy_listener.link);
+    }
+    wl_list_remove(&watch->link);
+    free(watch);
+}
+
+static void
+wakefield_watch_surface(struct wl_client *client,
+                        struct wl_resource *resource,
+                        uint32_t id,
+                        struct wl_resource *surface_resource)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_surface_watch *watch = zalloc(sizeof(struct wakefield_surface_watch));
+    if (watch == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    watch->resource = wl_resource_create(client, &wakefield_surface_watch_interface,
+                                         wl_resource_get_version(resource), id);
+    if (watch->resource == NULL) {
+        free(watch);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    watch->wakefield        = wakefield;
+    watch->surface_resource = surface_resource;
+    watch->surface_destroy_listener.notify = surface_watch_surface_destroyed;
+    wl_resource_add_destroy_listener(surface_resource, &watch->surface_destroy_listener);
+    wl_list_insert(&wakefield->surface_watch_list, &watch->link);
+    wl_resource_set_implementation(watch->resource, &wakefield_surface_watch_implementation,
+                                   watch, surface_watch_resource_destroy);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: watching surface %d\n",
+                            wl_resource_get_id(surface_resource));
+
+    surface_watch_check(watch, true);
+}
+
+static void
+send_surfaces(struct wl_resource *resource, uint32_t serial, struct wl_array *surfaces)
+{
+    wakefield_send_surfaces(resource, serial, surfaces);
+    surfaces->size = 0;
+}
+
+/**
+ * Returns the index that the surfaces_output events give the given output, -1 if it has none.
+ */
+static int32_t
+get_surfaces_output_index(struct wakefield *wakefield, struct weston_output *target)
+{
+    int32_t index = 0;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        if (output == target)
+            return index;
+
+        index++;
+    }
+
+    return -1;
+}
+
+static void
+wakefield_get_surfaces(struct wl_client *client,
+                       struct wl_resource *resource,
+                       uint32_t flags,
+                       uint32_t serial)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_compositor *compositor = wakefield->compositor;
+
+    // The records refer to outputs by index, so that their names needn't be repeated for every surface.
+    int32_t n_outputs = 0;
+    struct weston_output *output;
+    wl_list_for_each(output, &compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        wakefield_send_surfaces_output(resource, serial, n_outputs++, output->name);
+    }
+
+    struct wl_array surfaces;
+    wl_array_init(&surfaces);
+
+    // The opaque parts of the views above the current one, for telling if the current one is visible.
+    pixman_region32_t covered;
+    pixman_region32_t visible;
+    pixman_region32_t visible_in_output;
+    pixman_region32_init(&covered);
+    pixman_region32_init(&visible);
+    pixman_region32_init(&visible_in_output);
+
+    uint32_t count    = 0;
+    uint32_t stacking = 0;
+    struct weston_layer *layer;
+    wl_list_for_each(layer, &compositor->layer_list, link) {
+        struct weston_view *view;
+        wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
+            if (!view->is_mapped)
+                continue;
+
+            struct weston_surface *surface = view->surface;
+            const bool own = surface->resource && wl_resource_get_client(surface->resource) == client;
+
+            pixman_region32_subtract(&visible, &view->transform.boundingbox, &covered);
+            if (view->alpha > 0.0f) {
+                pixman_region32_union(&covered, &covered, &view->transform.opaque);
+            }
+
+            if (!own && !(flags & WAKEFIELD_SURFACE_LIST_FLAGS_ALL_CLIENTS)) {
+                stacking++;
+                continue;
+            }
+
+            bool on_screen = false;
+            wl_list_for_each(output, &compositor->output_list, link) {
+                if (output->destroying)
+                    continue;
+
+                pixman_region32_intersect(&visible_in_output, &visible, &output->region);
+                on_screen |= pixman_region32_not_empty(&visible_in_output);
+            }
+
+            struct wakefield_surface_info *info = wl_array_add(&surfaces, sizeof(struct wakefield_surface_info));
+            if (info == NULL) {
+                weston_log_scope_printf(wakefield->log, "WAKEFIELD: failed to allocate surface list\n");
+                wl_resource_post_no_memory(resource);
+                pixman_region32_fini(&visible_in_output);
+                pixman_region32_fini(&visible);
+                pixman_region32_fini(&covered);
+                wl_array_release(&surfaces);
+                return;
+            }
+
+            float fx;
+            float fy;
+            weston_view_to_global_float(view, 0, 0, &fx, &fy);
+            info->surface  = own ? wl_resource_get_id(surface->resource) : 0;
+            info->x        = (int32_t)fx;
+            info->y        = (int32_t)fy;
+            info->width    = surface->width;
+            info->height   = surface->height;
+            info->stacking = stacking++;
+            info->output   = view->output ? get_surfaces_output_index(wakefield, view->output) : -1;
+            info->flags    = (own ? WAKEFIELD_SURFACE_FLAGS_OWN : 0)
+                             | (on_screen && view->alpha > 0.0f ? WAKEFIELD_SURFACE_FLAGS_VISIBLE : 0);
+            count++;
+
+            if (surfaces.size == WAKEFIELD_SURFACES_PER_EVENT * sizeof(struct wakefield_surface_info)) {
+                send_surfaces(resource, serial, &surfaces);
+            }
+        }
+    }
+
+    if (surfaces.size > 0) {
+        send_surfaces(resource, serial, &surfaces);
+    }
+    wakefield_send_surfaces_done(resource, serial, count);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: get_surfaces listed %d surface(s)\n", count);
+
+    pixman_region32_fini(&visible_in_output);
+    pixman_region32_fini(&visible);
+    pixman_region32_fini(&covered);
+    wl_array_release(&surfaces);
+}
+
+/**
+ * Returns the number of pixels in the given non-empty region.
+ */
+static uint64_t
+size_in_pixels(pixman_region32_t *region)
+{
+    const pixman_box32_t * const e = pixman_region32_extents(region);
+    assert (e->x2 >= e->x1);
+    assert (e->y2 >= e->y1);
+
+    return ((uint64_t)(e->x2 - e->x1))*(e->y2 - e->y1);
+}
+
+/**
+ * Get the number of pixels of the largest portion that the given region occupies on
+ * any of the compositor's outputs.
+ *
+ * @param fits_entirely (OUT) set to true iff the entire region fits as a whole on just one output
+ * @return largest area size in pixels (could be zero).
+ */
+static uint64_t
+get_largest_area_in_one_output(struct weston_compositor *compositor, pixman_region32_t *region, bool *fits_entirely)
+{
+    uint64_t area = 0; // in pixels
+    *fits_entirely = false;
+
+    pixman_region32_t region_in_output;
+    pixman_region32_init(&region_in_output);
+
+    struct weston_output *output;
+    wl_list_for_each(output, &compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        pixman_region32_intersect(&region_in_output, region, &output->region);
+        if (pixman_region32_not_empty(&region_in_output)) {
+            const uint64_t this_area = size_in_pixels(&region_in_output);
             if (this_area > area) {
                 area = this_area;
             }
-            if (pixman_region32_equal(&region_in_output, region)) {
-                *fits_entirely = true;
-                break;
+            if (pixman_region32_equal(&region_in_output, region)) {
+                *fits_entirely = true;
+                break;
+            }
+        }
+    }
+
+    pixman_region32_fini(&region_in_output);
+
+    return area;
+}
+
+/**
+ * Sets every pixel of the given rectangle of the given buffer to 0.
+ */
+static void
+clear_box_in_shm_buffer(struct wl_shm_buffer *buffer,
+                        int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    const size_t bpp    = wakefield_shm_format_bpp(wl_shm_buffer_get_format(buffer)); // byte-per-pixel
+    const size_t stride = wl_shm_buffer_get_stride(buffer);
+
+    wl_shm_buffer_begin_access(buffer);
+    {
+        uint8_t *data = wl_shm_buffer_get_data(buffer);
+        for (int32_t row = y; row < y + height; row++) {
+            memset(&data[row*stride + x*bpp], 0, width*bpp);
+        }
+    }
+    wl_shm_buffer_end_access(buffer);
+}
+
+/**
+ * Sets to 0 the pixels of the given buffer whose top-left corner is at the absolute coordinates (x, y)
+ * that belong to those parts of the given region (in global coordinates) that no output covers.
+ * The rest of the region is going to be overwritten with the screen pixels anyway.
+ * src/bench.c has a copy of this logic for timing it; keep the two in line.
+ */
+static void
+clear_uncovered_area(struct wakefield *wakefield, struct wl_shm_buffer *buffer,
+                     int32_t x, int32_t y, pixman_region32_t *region)
+{
+    pixman_region32_t uncovered;
+    pixman_region32_init(&uncovered);
+    pixman_region32_copy(&uncovered, region);
+
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        pixman_region32_subtract(&uncovered, &uncovered, &output->region);
+    }
+
+    if (pixman_region32_not_empty(&uncovered)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: clearing %d box(es) of the capture not covered by any output, "
+                                "%ld pixel(s) in their extents\n",
+                                pixman_region32_n_rects(&uncovered), size_in_pixels(&uncovered));
+    }
+
+    int n_boxes;
+    const pixman_box32_t * const boxes = pixman_region32_rectangles(&uncovered, &n_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+        clear_box_in_shm_buffer(buffer, boxes[i].x1 - x, boxes[i].y1 - y,
+                                boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+    }
+
+    pixman_region32_fini(&uncovered);
+}
+
+/**
+ * Copies pixels from the given array to the given buffer at the given offset
+ * into the buffer converting them to the buffer's format.
+ *
+ * @param buffer      target buffer (format must be supported by wakefield_get_convert_row_func())
+ * @param data        array of pixels of size (width*height)
+ * @param data_format format of the pixels in data
+ * @param target_x    horizontal coordinate of the top-left corner in the buffer
+ *                    where the given data should be placed
+ * @param target_y    vertical coordinate of the top-left corner in the buffer
+ *                    where the given data should be placed
+ * @param width       the source image width in pixels
+ * @param height      the source image height in pixels
+ */
+static void
+copy_pixels_to_shm_buffer(struct wl_shm_buffer *buffer, const void *data, pixman_format_code_t data_format,
+                          int32_t target_x, int32_t target_y,
+                          int32_t width, int32_t height)
+{
+    assert (target_x >= 0 && target_y >= 0);
+    assert (data);
+
+    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(data_format, buffer_format);
+    assert (convert);
+
+    const size_t src_stride = (size_t)width * (PIXMAN_FORMAT_BPP(data_format) / 8);
+    const size_t dst_stride = wl_shm_buffer_get_stride(buffer);
+    const size_t dst_bpp    = wakefield_shm_format_bpp(buffer_format);
+
+    wl_shm_buffer_begin_access(buffer);
+    {
+        uint8_t * const buffer_data = wl_shm_buffer_get_data(buffer);
+        assert (buffer_data);
+
+        for (int32_t y = 0; y < height; y++) {
+            const uint8_t * const src_line = (const uint8_t *)data + y*src_stride;
+            uint8_t * const       dst_line = &buffer_data[(target_y + y)*dst_stride];
+            convert(&dst_line[target_x*dst_bpp], src_line, width);
+        }
+    }
+    wl_shm_buffer_end_access(buffer);
+}
+
+/**
+ * Returns true iff pixels read from the compositor can be converted to the given wl_shm format.
+ */
+static bool
+is_buffer_format_supported(struct wakefield *wakefield, uint32_t buffer_format)
+{
+    return wakefield_get_convert_row_func(wakefield->compositor->read_format, buffer_format) != NULL;
+}
+
+/**
+ * Reads a rectangle of pixels of the given output into the given buffer with the top-left
+ * corner at (target_x, target_y) in the buffer. The pixels go straight into the buffer if it
+ * has the compositor's format and the rows can be read with the buffer's stride;
+ * otherwise they are read into temporary memory first and then converted into the buffer.
+ *
+ * @param temp memory for width*height pixels in the compositor's read_format
+ *             or NULL to use the scratch arena
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+read_output_box_into_buffer(struct wakefield *wakefield, struct weston_output *output,
+                            struct wl_shm_buffer *buffer,
+                            int32_t x_in_output, int32_t y_in_output, int32_t width, int32_t height,
+                            int32_t target_x, int32_t target_y, void *temp)
+{
+    const pixman_format_code_t read_format   = wakefield->compositor->read_format;
+    const uint32_t             buffer_format = wl_shm_buffer_get_format(buffer);
+    const size_t               bpp           = PIXMAN_FORMAT_BPP(read_format) / 8; // byte-per-pixel
+
+    if (pixman_formats_compatible(read_format, wakefield_shm_format_to_pixman(buffer_format))) {
+        const size_t stride = wl_shm_buffer_get_stride(buffer);
+        int rc;
+        wl_shm_buffer_begin_access(buffer);
+        {
+            uint8_t *data = wl_shm_buffer_get_data(buffer);
+            rc = read_output_pixels_strided(wakefield, output, read_format,
+                                            &data[target_y*stride + target_x*bpp], stride,
+                                            x_in_output, y_in_output, width, height);
+        }
+        wl_shm_buffer_end_access(buffer);
+        if (rc == 0) {
+            return WAKEFIELD_ERROR_NO_ERROR;
+        }
+    }
+
+    int rc;
+    wl_shm_buffer_begin_access(buffer);
+    {
+        const size_t stride = wl_shm_buffer_get_stride(buffer);
+        uint8_t *data = wl_shm_buffer_get_data(buffer);
+        rc = convert_output_pixels_directly(wakefield, output, buffer_format,
+                                            &data[target_y*stride + target_x*wakefield_shm_format_bpp(buffer_format)],
+                                            stride, x_in_output, y_in_output, width, height);
+    }
+    wl_shm_buffer_end_access(buffer);
+    if (rc == 0) {
+        return WAKEFIELD_ERROR_NO_ERROR;
+    }
+
+    void *pixels = temp ? temp : wakefield_scratch_get(&wakefield->scratch, (size_t)width * height * bpp);
+    if (pixels == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: failed to allocate %ld bytes for temporary capture buffer.\n",
+                                (size_t)width * height * bpp);
+        return WAKEFIELD_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (read_output_pixels(wakefield, output, read_format, pixels,
+                           x_in_output, y_in_output, width, height) < 0)
+        return WAKEFIELD_ERROR_INTERNAL;
+
+    copy_pixels_to_shm_buffer(buffer, pixels, read_format, target_x, target_y, width, height);
+
+    return WAKEFIELD_ERROR_NO_ERROR;
+}
+
+/**
+ * Verifies that the given buffer format is supported and sends the "capture ready" event
+ * with the appropriate error code if it wasn't.
+ */
+static bool
+check_buffer_format_supported(struct wakefield *wakefield, struct wl_resource *resource,
+                              struct wl_resource *buffer_resource, uint32_t buffer_format)
+{
+    if (!is_buffer_format_supported(wakefield, buffer_format)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: buffer for image capture has unsupported format %d, "
+                                "check codes in enum 'format' in wayland.xml\n",
+                                buffer_format);
+        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_FORMAT);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Verifies that the given buffer type is shm and sends the "capture ready" event
+ * with the appropriate error code if it wasn't.
+ */
+static bool
+check_buffer_type_supported(struct wakefield *wakefield, struct wl_resource *resource,
+                            struct wl_resource *buffer_resource)
+{
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+
+    if (!buffer) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: buffer for image capture not from wl_shm\n");
+        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_INTERNAL);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Verifies that the given capture area is not empty and sends the successful "capture ready" event
+ * if it was.
+ */
+static bool
+capture_is_empty(struct wakefield *wakefield, struct wl_resource *resource,
+                    struct wl_resource *buffer_resource, uint64_t largest_capture_area)
+{
+    if (largest_capture_area == 0) {
+        // All outputs might've just disappeared
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: captured area size on all outputs is zero.\n");
+        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_NO_ERROR);
+        return true;
+    }
+
+    return false;
+}
+
+// Captures with fewer pixels than this are read on the compositor thread alone.
+#define WAKEFIELD_PARALLEL_CAPTURE_MIN_PIXELS (512*512)
+
+// Every band of a capture read in parallel has at least this many rows.
+#define WAKEFIELD_CAPTURE_BAND_MIN_ROWS 32
+
+/**
+ * A band of rows of one output that a job reads into a capture buffer.
+ */
+struct wakefield_capture_band {
+    struct weston_output *output;
+    int32_t  x_in_output;
+    int32_t  y_in_output;
+    int32_t  width;
+    int32_t  height;
+    int32_t  target_x;     // in the buffer
+    int32_t  target_y;
+    size_t   temp_offset;  // of temp in the scratch memory of the capture
+    uint8_t *temp;         // memory for width*height pixels in read_format
+    uint32_t error_code;
+};
+
+struct wakefield_capture_bands {
+    struct wakefield     *wakefield;
+    struct wl_shm_buffer *buffer;
+    struct wl_array       bands; // wakefield_capture_band
+};
+
+static void
+capture_band_job(void *data, int index)
+{
+    struct wakefield_capture_bands *bands = data;
+    struct wakefield_capture_band *band = &((struct wakefield_capture_band *)bands->bands.data)[index];
+
+    band->error_code = read_output_box_into_buffer(bands->wakefield, band->output, bands->buffer,
+                                                   band->x_in_output, band->y_in_output,
+                                                   band->width, band->height,
+                                                   band->target_x, band->target_y, band->temp);
+}
+
+/**
+ * Reads the given region (in global coordinates) of the screen into the buffer whose top-left
+ * corner is at the absolute coordinates (x, y). The part of the region on each output is split
+ * into bands of rows that the worker threads read and convert in parallel. The outputs'
+ * snapshots are refreshed beforehand so that the workers only copy from them; without the
+ * snapshot cache, the workers would call the renderer's read_pixels(), which the pixman renderer
+ * allows, but the GL renderer doesn't, so with GL the bands are then read on the compositor thread.
+ *
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+read_region_into_buffer_in_parallel(struct wakefield *wakefield, struct wl_shm_buffer *buffer,
+                                    int32_t x, int32_t y, pixman_region32_t *region)
+{
+    const size_t bpp = PIXMAN_FORMAT_BPP(wakefield->compositor->read_format) / 8; // byte-per-pixel
+    const int32_t bands_per_output = 2 * (wakefield->workers.n_threads + 1);
+
+    struct wakefield_capture_bands bands = { .wakefield = wakefield, .buffer = buffer };
+    wl_array_init(&bands.bands);
+
+    pixman_region32_t region_in_output;
+    pixman_region32_init(&region_in_output);
+
+    // Only the GL renderer flips captures vertically, and its context is bound to the compositor thread.
+    const bool gl_renderer = (wakefield->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) != 0;
+
+    bool     parallel   = wakefield->snapshot_cache || !gl_renderer;
+    size_t   temp_size  = 0;
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying || error_code != WAKEFIELD_ERROR_NO_ERROR)
+            continue;
+
+        pixman_region32_intersect(&region_in_output, region, &output->region);
+        if (!pixman_region32_not_empty(&region_in_output))
+            continue;
+
+        // A snapshot that could not be taken would be retried by every worker.
+        struct wakefield_output *wo = get_wakefield_output(wakefield, output);
+        if (wakefield->snapshot_cache && wo && !refresh_snapshot(wo)) {
+            parallel = false;
+        }
+
+        const pixman_box32_t * const e = pixman_region32_extents(&region_in_output);
+        const int32_t height    = e->y2 - e->y1;
+        const int32_t band_rows = MAX(WAKEFIELD_CAPTURE_BAND_MIN_ROWS,
+                                      (height + bands_per_output - 1) / bands_per_output);
+        for (int32_t row = 0; row < height; row += band_rows) {
+            struct wakefield_capture_band *band = wl_array_add(&bands.bands, sizeof(struct wakefield_capture_band));
+            if (band == NULL) {
+                error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+                break;
+            }
+
+            band->output      = output;
+            band->x_in_output = e->x1 - output->x;
+            band->y_in_output = e->y1 + row - output->y;
+            band->width       = e->x2 - e->x1;
+            band->height      = MIN(band_rows, height - row);
+            band->target_x    = e->x1 - x;
+            band->target_y    = e->y1 + row - y;
+            band->temp_offset = temp_size;
+            band->temp        = NULL;
+            band->error_code  = WAKEFIELD_ERROR_NO_ERROR;
+            temp_size += (size_t)band->width * band->height * bpp;
+        }
+    }
+
+    pixman_region32_fini(&region_in_output);
+
+    const int n_bands = bands.bands.size / sizeof(struct wakefield_capture_band);
+    uint8_t *temp = NULL;
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR && n_bands > 0) {
+        temp = wakefield_scratch_get(&wakefield->scratch, temp_size);
+        if (temp == NULL) {
+            weston_log_scope_printf(wakefield->log,
+                                    "WAKEFIELD: failed to allocate %ld bytes for temporary capture buffer.\n",
+                                    temp_size);
+            error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        struct wakefield_capture_band *band;
+        wl_array_for_each(band, &bands.bands) {
+            band->temp = &temp[band->temp_offset];
+        }
+
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: reading %d band(s) of the capture with %d thread(s)\n",
+                                n_bands, parallel ? wakefield->workers.n_threads + 1 : 1);
+
+        if (parallel) {
+            wakefield_workers_run(&wakefield->workers, capture_band_job, &bands, n_bands);
+        } else {
+            for (int i = 0; i < n_bands; i++) {
+                capture_band_job(&bands, i);
+            }
+        }
+
+        wl_array_for_each(band, &bands.bands) {
+            if (band->error_code != WAKEFIELD_ERROR_NO_ERROR) {
+                error_code = band->error_code;
+                break;
+            }
+        }
+    }
+
+    wl_array_release(&bands.bands);
+
+    return error_code;
+}
+
+/**
+ * Captures the screen area of the size of the given buffer at the given absolute
+ * coordinates into that buffer and sends the "capture ready" event.
+ */
+static void
+capture_into_buffer(struct wakefield *wakefield,
+                    struct wl_resource *resource,
+                    struct wl_resource *buffer_resource,
+                    int32_t x,
+                    int32_t y)
+{
+    if (!check_buffer_type_supported(wakefield, resource, buffer_resource)) {
+        return;
+    }
+
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+    assert (buffer); // actually, verified earlier
+    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
+    if (!check_buffer_format_supported(wakefield, resource, buffer_resource, buffer_format)) {
+        return;
+    }
+
+    const int32_t width  = wl_shm_buffer_get_width(buffer);
+    const int32_t height = wl_shm_buffer_get_height(buffer);
+
+    pixman_region32_t region_global;    // capture region in global coordinates
+    pixman_region32_t region_in_output; // capture region in a particular output in that output's coordinates
+
+    pixman_region32_init_rect(&region_global, x, y, width, height);
+    pixman_region32_init(&region_in_output);
+
+    // Only the part of the capture that is out of screen has to be cleared,
+    // the rest is overwritten with the screen pixels below.
+    clear_uncovered_area(wakefield, buffer, x, y, &region_global);
+
+    bool fits_entirely;
+    const uint64_t largest_capture_area = get_largest_area_in_one_output(wakefield->compositor, &region_global, &fits_entirely);
+    if (capture_is_empty(wakefield, resource, buffer_resource, largest_capture_area)) {
+        pixman_region32_fini(&region_in_output);
+        pixman_region32_fini(&region_global);
+        return;
+    }
+
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    if (wakefield->workers.n_threads > 0 && size_in_pixels(&region_global) >= WAKEFIELD_PARALLEL_CAPTURE_MIN_PIXELS) {
+        error_code = read_region_into_buffer_in_parallel(wakefield, buffer, x, y, &region_global);
+    } else {
+        struct weston_output *output;
+        wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+            if (output->destroying)
+                continue;
+
+            pixman_region32_intersect(&region_in_output, &region_global, &output->region);
+            if (pixman_region32_not_empty(&region_in_output)) {
+                const pixman_box32_t * const e = pixman_region32_extents(&region_in_output);
+
+                const int32_t region_x_in_global = e->x1;
+                const int32_t region_y_in_global = e->y1;
+                const int32_t width_in_output    = e->x2 - e->x1;
+                const int32_t height_in_output   = e->y2 - e->y1;
+                weston_log_scope_printf(wakefield->log, "WAKEFIELD: output '%s' has a chunk of the image at (%d, %d) sized (%d, %d)\n",
+                                        output->name,
+                                        e->x1, e->y1,
+                                        width_in_output, height_in_output);
+
+                // Better, but not available in the current libweston:
+                // weston_output_region_from_global(output, &region_in_output);
+
+                // Now convert region_in_output from global to output-local coordinates.
+                pixman_region32_translate(&region_in_output, -output->x, -output->y);
+
+                const pixman_box32_t * const e_in_output = pixman_region32_extents(&region_in_output);
+                const int32_t x_in_output = e_in_output->x1;
+                const int32_t y_in_output = e_in_output->y1;
+
+                weston_log_scope_printf(wakefield->log,
+                                        "WAKEFIELD: grabbing pixels at (%d, %d) of size %dx%d, format %s\n",
+                                        x_in_output, y_in_output,
+                                        width_in_output, height_in_output,
+                                        wakefield_shm_format_name(buffer_format));
+
+                error_code = read_output_box_into_buffer(wakefield, output, buffer,
+                                                         x_in_output, y_in_output,
+                                                         width_in_output, height_in_output,
+                                                         region_x_in_global - x, region_y_in_global - y, NULL);
+                if (error_code != WAKEFIELD_ERROR_NO_ERROR || fits_entirely) {
+                    // In case of the entire region located on just one output,
+                    // we have just processed it, so can exit immediately.
+                    break;
+                }
+            }
+        }
+    }
+
+    pixman_region32_fini(&region_in_output);
+    pixman_region32_fini(&region_global);
+
+    wakefield_scratch_done(&wakefield->scratch);
+
+    wakefield_send_capture_ready(resource, buffer_resource, error_code);
+}
+
+static void
+wakefield_capture_create(struct wl_client *client,
+                         struct wl_resource *resource,
+                         struct wl_resource *buffer_resource,
+                         int32_t x,
+                         int32_t y)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    capture_into_buffer(wakefield, resource, buffer_resource, x, y);
+}
+
+/**
+ * Composites the contents of the surface onto the image with the surface's top-left corner at (x, y).
+ *
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+draw_surface_contents(struct wakefield *wakefield, struct weston_surface *surface,
+                      pixman_image_t *target, int32_t x, int32_t y)
+{
+    int width;
+    int height;
+    weston_surface_get_content_size(surface, &width, &height);
+    if (width <= 0 || height <= 0)
+        return WAKEFIELD_ERROR_INTERNAL;
+
+    const size_t size = (size_t)width * height * sizeof(uint32_t);
+    uint32_t *pixels = wakefield_scratch_get(&wakefield->scratch, size);
+    if (pixels == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: failed to allocate %ld bytes for surface contents.\n", size);
+        return WAKEFIELD_ERROR_OUT_OF_MEMORY;
+    }
+
+    // The renderer hands out premultiplied RGBA in memory order, which is a8b8g8r8 on little-endian CPUs.
+    if (weston_surface_copy_content(surface, pixels, size, 0, 0, width, height) < 0)
+        return WAKEFIELD_ERROR_INTERNAL;
+
+    pixman_image_t *image = pixman_image_create_bits(PIXMAN_a8b8g8r8, width, height,
+                                                     pixels, width * sizeof(uint32_t));
+    if (image == NULL)
+        return WAKEFIELD_ERROR_OUT_OF_MEMORY;
+
+    pixman_image_composite32(PIXMAN_OP_OVER, image, NULL, target, 0, 0, 0, 0, x, y, width, height);
+    pixman_image_unref(image);
+
+    return WAKEFIELD_ERROR_NO_ERROR;
+}
+
+/**
+ * Composites the surface and, if asked to, its subsurfaces from the bottom up onto the image
+ * with the surface's top-left corner at (x, y) in buffer pixels. The subsurfaces that have
+ * no contents are skipped, and so are those whose buffers have a different scale than the
+ * surface's or are transformed, which would need resampling.
+ *
+ * @return an error code from the wakefield error enum that concerns the surface itself.
+ */
+static uint32_t
+draw_surface(struct wakefield *wakefield, struct weston_surface *surface,
+             pixman_image_t *target, int32_t x, int32_t y, bool subsurfaces)
+{
+    if (!subsurfaces || wl_list_empty(&surface->subsurface_list))
+        return draw_surface_contents(wakefield, surface, target, x, y);
+
+    // The positions of the subsurfaces are in the surface coordinates, not in buffer pixels.
+    const struct weston_buffer_viewport *viewport = &surface->buffer_viewport;
+    const int32_t scale = viewport->buffer.scale;
+
+    // The list goes from the top down and includes the surface itself to mark its place in the stack.
+    uint32_t error_code = WAKEFIELD_ERROR_INTERNAL;
+    struct weston_subsurface *sub;
+    wl_list_for_each_reverse(sub, &surface->subsurface_list, parent_link) {
+        if (sub->surface == surface) {
+            error_code = draw_surface_contents(wakefield, surface, target, x, y);
+        } else if (sub->surface->buffer_viewport.buffer.scale != scale
+                   || sub->surface->buffer_viewport.buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL
+                   || viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+            weston_log_scope_printf(wakefield->log,
+                                    "WAKEFIELD: skipped subsurface with a different buffer scale or transform\n");
+        } else {
+            draw_surface(wakefield, sub->surface, target,
+                         x + sub->position.x * scale, y + sub->position.y * scale, true);
+        }
+    }
+
+    return error_code;
+}
+
+static void
+wakefield_capture_surface(struct wl_client *client,
+                          struct wl_resource *resource,
+                          struct wl_resource *buffer_resource,
+                          struct wl_resource *surface_resource,
+                          uint32_t flags)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
+
+    if (!check_buffer_type_supported(wakefield, resource, buffer_resource))
+        return;
+
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
+    const pixman_format_code_t format = wakefield_shm_format_to_pixman(buffer_format);
+    if (format == 0) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: buffer for surface capture has unsupported format %d, "
+                                "check codes in enum 'format' in wayland.xml\n",
+                                buffer_format);
+        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+
+    const int32_t width  = wl_shm_buffer_get_width(buffer);
+    const int32_t height = wl_shm_buffer_get_height(buffer);
+    const int32_t stride = wl_shm_buffer_get_stride(buffer);
+
+    uint32_t error_code;
+    wl_shm_buffer_begin_access(buffer);
+    {
+        uint8_t *data = wl_shm_buffer_get_data(buffer);
+        for (int32_t row = 0; row < height; row++) {
+            memset(&data[(size_t)row*stride], 0, (size_t)width * PIXMAN_FORMAT_BPP(format) / 8);
+        }
+
+        pixman_image_t *target = pixman_image_create_bits(format, width, height, (uint32_t *)data, stride);
+        if (target) {
+            error_code = draw_surface(wakefield, surface, target, 0, 0,
+                                      flags & WAKEFIELD_CAPTURE_SURFACE_FLAGS_SUBSURFACES);
+            pixman_image_unref(target);
+        } else {
+            error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    wl_shm_buffer_end_access(buffer);
+    wakefield_scratch_done(&wakefield->scratch);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: capture_surface %d into (%d, %d), error %d\n",
+                            wl_resource_get_id(surface_resource), width, height, error_code);
+
+    wakefield_send_capture_ready(resource, buffer_resource, error_code);
+}
+
+static void
+pending_capture_destroy(struct wakefield_pending_capture *capture)
+{
+    wl_list_remove(&capture->buffer_destroy_listener.link);
+    wl_list_remove(&capture->link);
+    free(capture);
+}
+
+static void
+pending_capture_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+    struct wakefield_pending_capture *capture = container_of(listener, struct wakefield_pending_capture,
+                                                             buffer_destroy_listener);
+
+    weston_log_scope_printf(capture->wakefield->log,
+                            "WAKEFIELD: buffer destroyed before the capture was made\n");
+    pending_capture_destroy(capture);
+}
+
+/**
+ * Makes those of the pending captures that no longer wait for any output.
+ */
+static void
+complete_pending_captures(struct wakefield *wakefield)
+{
+    struct wakefield_pending_capture *capture, *tmp;
+    wl_list_for_each_safe(capture, tmp, &wakefield->pending_capture_list, link) {
+        if (capture->output_mask == 0) {
+            capture_into_buffer(wakefield, capture->resource, capture->buffer_resource,
+                                capture->x, capture->y);
+            pending_capture_destroy(capture);
+        }
+    }
+}
+
+/**
+ * Notes that the given output has been repainted or has gone and makes the captures that were
+ * waiting for it last.
+ */
+static void
+pending_captures_output_done(struct wakefield *wakefield, struct weston_output *output)
+{
+    struct wakefield_pending_capture *capture;
+    wl_list_for_each(capture, &wakefield->pending_capture_list, link) {
+        capture->output_mask &= ~(1u << output->id);
+    }
+
+    complete_pending_captures(wakefield);
+}
+
+/**
+ * Notes that the given output has been repainted or has gone and sends the done event
+ * for the syncs that were waiting for it last.
+ */
+static void
+syncs_output_done(struct wakefield *wakefield, struct weston_output *output)
+{
+    struct wakefield_sync *sync, *tmp;
+    wl_list_for_each_safe(sync, tmp, &wakefield->sync_list, link) {
+        sync->output_mask &= ~(1u << output->id);
+        if (sync->output_mask == 0) {
+            wl_list_remove(&sync->link);
+            wl_list_init(&sync->link);
+            wakefield_sync_send_done(sync->resource);
+        }
+    }
+}
+
+static void
+sync_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void
+sync_handle_add_surface(struct wl_client *client,
+                        struct wl_resource *resource,
+                        struct wl_resource *surface_resource)
+{
+    struct wakefield_sync *sync = wl_resource_get_user_data(resource);
+    struct weston_surface *surface = wl_resource_get_user_data(surface_resource);
+    struct weston_compositor *compositor = sync->wakefield->compositor;
+
+    // The outputs that showed the surface as of the last repaint need to repaint where it was,
+    // and those where its latest commit or move puts it need to paint it there.
+    uint32_t output_mask = surface->output_mask;
+    struct weston_view *view;
+    wl_list_for_each(view, &surface->views, surface_link) {
+        if (view->transform.dirty) {
+            weston_view_update_transform(view);
+        }
+
+        pixman_box32_t box = *pixman_region32_extents(&view->transform.boundingbox);
+        struct weston_output *output;
+        wl_list_for_each(output, &compositor->output_list, link) {
+            if (output->destroying)
+                continue;
+
+            if (pixman_region32_contains_rectangle(&output->region, &box) != PIXMAN_REGION_OUT) {
+                output_mask |= 1u << output->id;
+            }
+        }
+    }
+
+    // A surface that hasn't been assigned any output yet, for instance because it has just been
+    // mapped, may end up on any of them.
+    if (output_mask == 0) {
+        output_mask = ~0u;
+    }
+
+    weston_log_scope_printf(sync->wakefield->log, "WAKEFIELD: sync added surface %d on outputs 0x%x\n",
+                            wl_resource_get_id(surface_resource), output_mask);
+
+    sync->surfaces_added       = true;
+    sync->surface_output_mask |= output_mask;
+}
+
+/**
+ * Starts waiting for the outputs with a pending repaint.
+ *
+ * @param hurry make the outputs whose repaint has been scheduled repaint right away; this relies
+ *              on how weston 9's repaint scheduler uses next_repaint and the repaint timer
+ */
+static void
+sync_start(struct wakefield_sync *sync, bool hurry)
+{
+    struct wakefield *wakefield = sync->wakefield;
+    struct weston_compositor *compositor = wakefield->compositor;
+
+    struct timespec now;
+    weston_compositor_read_presentation_clock(compositor, &now);
+
+    bool hurried = false;
+    sync->committed = true;
+    struct weston_output *output;
+    wl_list_for_each(output, &compositor->output_list, link) {
+        if (output->destroying || !get_wakefield_output(wakefield, output))
+            continue;
+
+        if (sync->surfaces_added && !(sync->surface_output_mask & (1u << output->id)))
+            continue;
+
+        if (output->repaint_needed) {
+            sync->output_mask |= 1u << output->id;
+        }
+
+#if WESTON_VERSION_MAJOR == 9
+        // The repaint timer repaints the scheduled outputs whose next_repaint has come;
+        // the outputs repainting from idle or completing a frame can't be hurried.
+        if (hurry && output->repaint_status == REPAINT_SCHEDULED) {
+            output->next_repaint = now;
+            hurried = true;
+        }
+#endif
+    }
+
+#if WESTON_VERSION_MAJOR == 9
+    if (hurried) {
+        wl_event_source_timer_update(compositor->repaint_timer, 1);
+    }
+#endif
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: sync waits for repaint of outputs 0x%x%s\n",
+                            sync->output_mask, hurried ? ", hurried" : "");
+
+    if (sync->output_mask == 0) {
+        wakefield_sync_send_done(sync->resource);
+    } else {
+        wl_list_insert(wakefield->sync_list.prev, &sync->link);
+    }
+}
+
+static void
+sync_handle_commit(struct wl_client *client, struct wl_resource *resource)
+{
+    struct wakefield_sync *sync = wl_resource_get_user_data(resource);
+
+    if (sync->committed) {
+        weston_log_scope_printf(sync->wakefield->log, "WAKEFIELD: sync committed again, ignored\n");
+        return;
+    }
+
+    sync_start(sync, false);
+}
+
+static const struct wakefield_sync_interface wakefield_sync_implementation = {
+        .destroy = sync_handle_destroy,
+        .add_surface = sync_handle_add_surface,
+        .commit = sync_handle_commit
+};
+
+static void
+sync_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_sync *sync = wl_resource_get_user_data(resource);
+
+    wl_list_remove(&sync->link);
+    free(sync);
+}
+
+static struct wakefield_sync *
+sync_create(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_sync *sync = zalloc(sizeof(struct wakefield_sync));
+    if (sync == NULL) {
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+
+    sync->resource = wl_resource_create(client, &wakefield_sync_interface,
+                                        wl_resource_get_version(resource), id);
+    if (sync->resource == NULL) {
+        free(sync);
+        wl_client_post_no_memory(client);
+        return NULL;
+    }
+
+    sync->wakefield = wakefield;
+    wl_list_init(&sync->link);
+    wl_resource_set_implementation(sync->resource, &wakefield_sync_implementation,
+                                   sync, sync_resource_destroy);
+    return sync;
+}
+
+static void
+wakefield_create_sync(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+    sync_create(client, resource, id);
+}
+
+static void
+wakefield_step(struct wl_client *client, struct wl_resource *resource, uint32_t id)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_sync *sync = sync_create(client, resource, id);
+    if (sync) {
+        sync_start(sync, wakefield->repaint_step);
+    }
+}
+
+static void
+wakefield_capture_create_after_repaint(struct wl_client *client,
+                                       struct wl_resource *resource,
+                                       struct wl_resource *buffer_resource,
+                                       int32_t x,
+                                       int32_t y)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    if (!check_buffer_type_supported(wakefield, resource, buffer_resource)) {
+        return;
+    }
+
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
+    if (!check_buffer_format_supported(wakefield, resource, buffer_resource, buffer_format)) {
+        return;
+    }
+
+    struct wakefield_pending_capture *capture = zalloc(sizeof(struct wakefield_pending_capture));
+    if (capture == NULL) {
+        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+
+    capture->wakefield       = wakefield;
+    capture->resource        = resource;
+    capture->buffer_resource = buffer_resource;
+    capture->x               = x;
+    capture->y               = y;
+    capture->buffer_destroy_listener.notify = pending_capture_buffer_destroyed;
+    wl_resource_add_destroy_listener(buffer_resource, &capture->buffer_destroy_listener);
+    wl_list_insert(wakefield->pending_capture_list.prev, &capture->link);
+
+    pixman_region32_t region_global;
+    pixman_region32_init_rect(&region_global, x, y,
+                              wl_shm_buffer_get_width(buffer), wl_shm_buffer_get_height(buffer));
+
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying || !get_wakefield_output(wakefield, output))
+            continue;
+
+        pixman_region32_t region_in_output;
+        pixman_region32_init(&region_in_output);
+        pixman_region32_intersect(&region_in_output, &region_global, &output->region);
+        if (pixman_region32_not_empty(&region_in_output)) {
+            capture->output_mask |= 1u << output->id;
+            weston_output_schedule_repaint(output);
+        }
+        pixman_region32_fini(&region_in_output);
+    }
+
+    pixman_region32_fini(&region_global);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: capture at (%d, %d) waits for repaint of outputs 0x%x\n",
+                            x, y, capture->output_mask);
+
+    // Nothing to wait for if the capture area is entirely off-screen.
+    complete_pending_captures(wakefield);
+}
+
+/**
+ * The maximum number of boxes reported by the wakefield_capture.ready event;
+ * more fragmented damage is re-read and reported as its bounding box.
+ */
+#define WAKEFIELD_CAPTURE_MAX_BOXES 64
+
+/**
+ * Reads the given region (in global coordinates) of the screen into the given buffer
+ * whose top-left corner is at the absolute coordinates (x, y). The parts of the region
+ * that no output covers are cleared.
+ *
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+read_region_into_buffer(struct wakefield *wakefield, struct wl_shm_buffer *buffer,
+                        int32_t x, int32_t y, pixman_region32_t *region)
+{
+    pixman_region32_t region_in_output;
+    pixman_region32_init(&region_in_output);
+
+    clear_uncovered_area(wakefield, buffer, x, y, region);
+
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        pixman_region32_intersect(&region_in_output, region, &output->region);
+        int n_boxes;
+        const pixman_box32_t * const boxes = pixman_region32_rectangles(&region_in_output, &n_boxes);
+        for (int i = 0; i < n_boxes && error_code == WAKEFIELD_ERROR_NO_ERROR; i++) {
+            error_code = read_output_box_into_buffer(wakefield, output, buffer,
+                                                     boxes[i].x1 - output->x, boxes[i].y1 - output->y,
+                                                     boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1,
+                                                     boxes[i].x1 - x, boxes[i].y1 - y, NULL);
+        }
+    }
+
+    wakefield_scratch_done(&wakefield->scratch);
+    pixman_region32_fini(&region_in_output);
+
+    return error_code;
+}
+
+/**
+ * Adds the given damage (in global coordinates) to every persistent capture it intersects.
+ * A NULL damage means that the entire area of every capture should be re-read.
+ */
+static void
+damage_captures(struct wakefield *wakefield, pixman_region32_t *damage)
+{
+    struct wakefield_capture *capture;
+    wl_list_for_each(capture, &wakefield->capture_list, link) {
+        if (damage) {
+            pixman_region32_union(&capture->damage, &capture->damage, damage);
+        } else {
+            pixman_region32_union_rect(&capture->damage, &capture->damage,
+                                       capture->x, capture->y, capture->width, capture->height);
+        }
+        pixman_region32_intersect_rect(&capture->damage, &capture->damage,
+                                       capture->x, capture->y, capture->width, capture->height);
+    }
+}
+
+static void
+capture_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void
+capture_handle_update(struct wl_client *client, struct wl_resource *resource)
+{
+    struct wakefield_capture *capture = wl_resource_get_user_data(resource);
+    struct wakefield *wakefield = capture->wakefield;
+
+    struct wl_array boxes_array;
+    wl_array_init(&boxes_array);
+
+    if (capture->buffer_resource == NULL) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: capture update with its buffer destroyed\n");
+        wakefield_capture_send_ready(resource, &boxes_array, WAKEFIELD_ERROR_INTERNAL);
+        return;
+    }
+
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(capture->buffer_resource);
+    if (buffer == NULL) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: buffer for image capture not from wl_shm\n");
+        wakefield_capture_send_ready(resource, &boxes_array, WAKEFIELD_ERROR_INTERNAL);
+        return;
+    }
+
+    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
+    if (!is_buffer_format_supported(wakefield, buffer_format)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: buffer for image capture has unsupported format %d, "
+                                "check codes in enum 'format' in wayland.xml\n",
+                                buffer_format);
+        wakefield_capture_send_ready(resource, &boxes_array, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+
+    pixman_region32_t *damage = &capture->damage;
+    int n_boxes = pixman_region32_n_rects(damage);
+    if (n_boxes > WAKEFIELD_CAPTURE_MAX_BOXES) {
+        // Too fragmented to report every box; re-read the bounding box instead.
+        pixman_box32_t extents = *pixman_region32_extents(damage);
+        pixman_region32_fini(damage);
+        pixman_region32_init_rect(damage, extents.x1, extents.y1,
+                                  extents.x2 - extents.x1, extents.y2 - extents.y1);
+    }
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: capture update at (%d, %d) sized (%d, %d), %d damaged box(es)\n",
+                            capture->x, capture->y, capture->width, capture->height,
+                            pixman_region32_n_rects(damage));
+
+    const uint32_t error_code = read_region_into_buffer(wakefield, buffer, capture->x, capture->y, damage);
+
+    const pixman_box32_t *boxes = pixman_region32_rectangles(damage, &n_boxes);
+    int32_t *reported = wl_array_add(&boxes_array, n_boxes * 4 * sizeof(int32_t));
+    if (n_boxes > 0 && reported == NULL) {
+        wl_resource_post_no_memory(resource);
+        return;
+    }
+    for (int i = 0; i < n_boxes; i++) {
+        reported[4*i + 0] = boxes[i].x1 - capture->x;
+        reported[4*i + 1] = boxes[i].y1 - capture->y;
+        reported[4*i + 2] = boxes[i].x2 - boxes[i].x1;
+        reported[4*i + 3] = boxes[i].y2 - boxes[i].y1;
+    }
+
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        pixman_region32_clear(damage);
+    }
+
+    wakefield_capture_send_ready(resource, &boxes_array, error_code);
+    wl_array_release(&boxes_array);
+}
+
+static const struct wakefield_capture_interface wakefield_capture_implementation = {
+        .destroy = capture_handle_destroy,
+        .update = capture_handle_update
+};
+
+static void
+capture_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+    struct wakefield_capture *capture = container_of(listener, struct wakefield_capture,
+                                                     buffer_destroy_listener);
+
+    wl_list_remove(&capture->buffer_destroy_listener.link);
+    wl_list_init(&capture->buffer_destroy_listener.link);
+    capture->buffer_resource = NULL;
+}
+
+static void
+capture_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_capture *capture = wl_resource_get_user_data(resource);
+
+    wl_list_remove(&capture->buffer_destroy_listener.link);
+    wl_list_remove(&capture->link);
+    pixman_region32_fini(&capture->damage);
+    free(capture);
+}
+
+static void
+wakefield_create_capture(struct wl_client *client,
+                         struct wl_resource *resource,
+                         uint32_t id,
+                         struct wl_resource *buffer_resource,
+                         int32_t x,
+                         int32_t y)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource); // verified on update
+
+    struct wakefield_capture *capture = zalloc(sizeof(struct wakefield_capture));
+    if (capture == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    capture->resource = wl_resource_create(client, &wakefield_capture_interface,
+                                           wl_resource_get_version(resource), id);
+    if (capture->resource == NULL) {
+        free(capture);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    capture->wakefield       = wakefield;
+    capture->buffer_resource = buffer_resource;
+    capture->x               = x;
+    capture->y               = y;
+    capture->width           = buffer ? wl_shm_buffer_get_width(buffer) : 0;
+    capture->height          = buffer ? wl_shm_buffer_get_height(buffer) : 0;
+    pixman_region32_init_rect(&capture->damage, x, y, capture->width, capture->height); // the first update reads everything
+    capture->buffer_destroy_listener.notify = capture_buffer_destroyed;
+    wl_resource_add_destroy_listener(buffer_resource, &capture->buffer_destroy_listener);
+    wl_list_insert(&wakefield->capture_list, &capture->link);
+
+    wl_resource_set_implementation(capture->resource, &wakefield_capture_implementation,
+                                   capture, capture_resource_destroy);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: created persistent capture at (%d, %d) sized (%d, %d)\n",
+                            x, y, capture->width, capture->height);
+}
+
+/**
+ * Returns true iff every channel of the given r8g8b8 colors differs by no more than tolerance.
+ */
+static bool
+color_within_tolerance(uint32_t a, uint32_t b, uint32_t tolerance)
+{
+    for (int shift = 0; shift < 24; shift += 8) {
+        const int32_t diff = (int32_t)((a >> shift) & 0xffu) - (int32_t)((b >> shift) & 0xffu);
+        if (diff > (int32_t)tolerance || -diff > (int32_t)tolerance) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Checks if every pixel of the area of the given condition has the expected color.
+ *
+ * @param matched (OUT) the result of the check; undefined in case of an error
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+check_condition(struct wakefield_condition *condition, bool *matched)
+{
+    struct wakefield *wakefield = condition->wakefield;
+    const pixman_format_code_t read_format = wakefield->compositor->read_format;
+    const size_t bpp = PIXMAN_FORMAT_BPP(read_format) / 8; // byte-per-pixel
+
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(read_format,
+                                                                                WL_SHM_FORMAT_XRGB8888);
+    if (convert == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: compositor pixel format %d (see pixman.h) not supported\n",
+                                read_format);
+        return WAKEFIELD_ERROR_FORMAT;
+    }
+
+    pixman_region32_t area;
+    pixman_region32_t area_in_output;
+    pixman_region32_init_rect(&area, condition->x, condition->y, condition->width, condition->height);
+    pixman_region32_init(&area_in_output);
+
+    // The pixels are read into the first part of the scratch memory,
+    // and each row is converted to r8g8b8 into the last part.
+    const size_t pixels_size = (size_t)condition->width * condition->height * bpp;
+    uint8_t *pixels = wakefield_scratch_get(&wakefield->scratch, pixels_size + condition->width * sizeof(uint32_t));
+    uint32_t error_code = pixels ? WAKEFIELD_ERROR_NO_ERROR : WAKEFIELD_ERROR_OUT_OF_MEMORY;
+    uint32_t * const row = pixels ? (uint32_t *)&pixels[pixels_size] : NULL;
+
+    *matched = true;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying || error_code != WAKEFIELD_ERROR_NO_ERROR || !*matched)
+            continue;
+
+        pixman_region32_intersect(&area_in_output, &area, &output->region);
+        if (!pixman_region32_not_empty(&area_in_output))
+            continue;
+
+        const pixman_box32_t * const e = pixman_region32_extents(&area_in_output);
+        const int32_t width  = e->x2 - e->x1;
+        const int32_t height = e->y2 - e->y1;
+        if (read_output_pixels(wakefield, output, read_format, pixels,
+                               e->x1 - output->x, e->y1 - output->y, width, height) < 0) {
+            error_code = WAKEFIELD_ERROR_INTERNAL;
+            continue;
+        }
+
+        for (int32_t y = 0; y < height && *matched; y++) {
+            convert(row, &pixels[(size_t)y*width*bpp], width);
+            for (int32_t x = 0; x < width; x++) {
+                if (!color_within_tolerance(row[x], condition->rgb, condition->tolerance)) {
+                    *matched = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    wakefield_scratch_done(&wakefield->scratch);
+    pixman_region32_fini(&area_in_output);
+    pixman_region32_fini(&area);
+
+    return error_code;
+}
+
+/**
+ * Sends the done event for the given condition and stops watching it.
+ */
+static void
+condition_finish(struct wakefield_condition *condition, uint32_t result, uint32_t error_code)
+{
+    weston_log_scope_printf(condition->wakefield->log,
+                            "WAKEFIELD: condition at (%d, %d) sized (%d, %d) done with result %d, error %d\n",
+                            condition->x, condition->y, condition->width, condition->height,
+                            result, error_code);
+
+    wakefield_condition_send_done(condition->resource, result, error_code);
+
+    condition->done = true;
+    wl_list_remove(&condition->link);
+    wl_list_init(&condition->link);
+    if (condition->timer) {
+        wl_event_source_remove(condition->timer);
+        condition->timer = NULL;
+    }
+}
+
+/**
+ * Re-checks the conditions whose area intersects the given damage (in global coordinates).
+ */
+static void
+check_conditions(struct wakefield *wakefield, pixman_region32_t *damage)
+{
+    struct wakefield_condition *condition, *tmp;
+    wl_list_for_each_safe(condition, tmp, &wakefield->condition_list, link) {
+        pixman_box32_t box = {
+                condition->x, condition->y,
+                condition->x + condition->width, condition->y + condition->height
+        };
+        if (pixman_region32_contains_rectangle(damage, &box) == PIXMAN_REGION_OUT)
+            continue;
+
+        bool matched;
+        const uint32_t error_code = check_condition(condition, &matched);
+        if (error_code != WAKEFIELD_ERROR_NO_ERROR) {
+            condition_finish(condition, WAKEFIELD_CONDITION_RESULT_ERROR, error_code);
+        } else if (matched) {
+            condition_finish(condition, WAKEFIELD_CONDITION_RESULT_MATCHED, WAKEFIELD_ERROR_NO_ERROR);
+        }
+    }
+}
+
+static int
+condition_timer_notify(void *data)
+{
+    struct wakefield_condition *condition = data;
+
+    condition_finish(condition, WAKEFIELD_CONDITION_RESULT_TIMEOUT, WAKEFIELD_ERROR_NO_ERROR);
+    return 0;
+}
+
+static void
+condition_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct wakefield_condition_interface wakefield_condition_implementation = {
+        .destroy = condition_handle_destroy
+};
+
+static void
+condition_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_condition *condition = wl_resource_get_user_data(resource);
+
+    wl_list_remove(&condition->link);
+    if (condition->timer) {
+        wl_event_source_remove(condition->timer);
+    }
+    free(condition);
+}
+
+/**
+ * Returns true iff the given area (in global coordinates) is entirely covered by outputs.
+ */
+static bool
+is_area_on_screen(struct wakefield *wakefield, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    // pixman computes the bottom-right corner in 32 bits.
+    if ((int64_t)x + width > INT32_MAX || (int64_t)y + height > INT32_MAX)
+        return false;
+
+    pixman_region32_t uncovered;
+    pixman_region32_init_rect(&uncovered, x, y, width, height);
+
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        pixman_region32_subtract(&uncovered, &uncovered, &output->region);
+    }
+
+    const bool on_screen = !pixman_region32_not_empty(&uncovered);
+    pixman_region32_fini(&uncovered);
+
+    return on_screen;
+}
+
+static void
+wakefield_wait_for_color(struct wl_client *client,
+                         struct wl_resource *resource,
+                         uint32_t id,
+                         int32_t x,
+                         int32_t y,
+                         int32_t width,
+                         int32_t height,
+                         uint32_t rgb,
+                         uint32_t tolerance,
+                         uint32_t timeout)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_condition *condition = zalloc(sizeof(struct wakefield_condition));
+    if (condition == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    condition->resource = wl_resource_create(client, &wakefield_condition_interface,
+                                             wl_resource_get_version(resource), id);
+    if (condition->resource == NULL) {
+        free(condition);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    condition->wakefield = wakefield;
+    condition->x         = x;
+    condition->y         = y;
+    condition->width     = width;
+    condition->height    = height;
+    condition->rgb       = rgb & 0x00ffffffu;
+    condition->tolerance = tolerance;
+    wl_list_insert(&wakefield->condition_list, &condition->link);
+    wl_resource_set_implementation(condition->resource, &wakefield_condition_implementation,
+                                   condition, condition_resource_destroy);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: wait_for_color 0x%06x (+/- %d) at (%d, %d) sized (%d, %d), timeout %d ms\n",
+                            condition->rgb, tolerance, x, y, width, height, timeout);
+
+    if (width <= 0 || height <= 0 || !is_area_on_screen(wakefield, x, y, width, height)) {
+        condition_finish(condition, WAKEFIELD_CONDITION_RESULT_ERROR, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    // The condition may already hold, no need to wait for a repaint then.
+    bool matched;
+    const uint32_t error_code = check_condition(condition, &matched);
+    if (error_code != WAKEFIELD_ERROR_NO_ERROR) {
+        condition_finish(condition, WAKEFIELD_CONDITION_RESULT_ERROR, error_code);
+        return;
+    }
+    if (matched) {
+        condition_finish(condition, WAKEFIELD_CONDITION_RESULT_MATCHED, WAKEFIELD_ERROR_NO_ERROR);
+        return;
+    }
+
+    if (timeout > 0) {
+        struct wl_event_loop *loop = wl_display_get_event_loop(wakefield->compositor->wl_display);
+        condition->timer = wl_event_loop_add_timer(loop, condition_timer_notify, condition);
+        if (condition->timer == NULL) {
+            condition_finish(condition, WAKEFIELD_CONDITION_RESULT_ERROR, WAKEFIELD_ERROR_OUT_OF_MEMORY);
+            return;
+        }
+        wl_event_source_timer_update(condition->timer, timeout);
+    }
+}
+
+/**
+ * Reads the given area (in global coordinates) of the screen into the scratch arena as pixels
+ * in the wl_shm argb8888 format laid out row by row with no padding, just like capture_into_buffer()
+ * would put them into an argb8888 buffer of the size of the area. The parts of the area that
+ * no output covers are set to 0. The pixels stay valid until wakefield_scratch_done() is called.
+ *
+ * @param pixels (OUT) the pixels read
+ * @return an error code from the wakefield error enum.
+ */
+static uint32_t
+read_area_into_scratch(struct wakefield *wakefield, int32_t x, int32_t y, int32_t width, int32_t height,
+                       uint32_t **pixels)
+{
+    const pixman_format_code_t read_format = wakefield->compositor->read_format;
+    const size_t bpp = PIXMAN_FORMAT_BPP(read_format) / 8; // byte-per-pixel
+
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(read_format,
+                                                                                WL_SHM_FORMAT_ARGB8888);
+    if (convert == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: compositor pixel format %d (see pixman.h) not supported\n",
+                                read_format);
+        return WAKEFIELD_ERROR_FORMAT;
+    }
+
+    // The area occupies the first part of the scratch memory; the pixels of each output
+    // are read into the last part unless they can go straight into the area.
+    const size_t stride    = (size_t)width * sizeof(uint32_t);
+    const size_t area_size = stride * height;
+    const size_t size      = area_size + (size_t)width * height * bpp;
+    uint8_t * const memory = wakefield_scratch_get(&wakefield->scratch, size);
+    if (memory == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: failed to allocate %ld bytes for temporary area buffer.\n", size);
+        return WAKEFIELD_ERROR_OUT_OF_MEMORY;
+    }
+    uint8_t * const output_pixels = &memory[area_size];
+
+    pixman_region32_t uncovered;
+    pixman_region32_t area_in_output;
+    pixman_region32_init_rect(&uncovered, x, y, width, height);
+    pixman_region32_init(&area_in_output);
+
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying || error_code != WAKEFIELD_ERROR_NO_ERROR)
+            continue;
+
+        pixman_region32_intersect_rect(&area_in_output, &output->region, x, y, width, height);
+        if (!pixman_region32_not_empty(&area_in_output))
+            continue;
+
+        pixman_region32_subtract(&uncovered, &uncovered, &area_in_output);
+
+        const pixman_box32_t * const e = pixman_region32_extents(&area_in_output);
+        const int32_t box_width  = e->x2 - e->x1;
+        const int32_t box_height = e->y2 - e->y1;
+        uint8_t * const target   = &memory[(e->y1 - y)*stride + (e->x1 - x)*sizeof(uint32_t)];
+
+        if (pixman_formats_compatible(read_format, PIXMAN_a8r8g8b8)
+            && read_output_pixels_strided(wakefield, output, read_format, target, stride,
+                                          e->x1 - output->x, e->y1 - output->y, box_width, box_height) == 0) {
+            continue;
+        }
+
+        if (convert_output_pixels_directly(wakefield, output, WL_SHM_FORMAT_ARGB8888, target, stride,
+                                           e->x1 - output->x, e->y1 - output->y, box_width, box_height) == 0) {
+            continue;
+        }
+
+        if (read_output_pixels(wakefield, output, read_format, output_pixels,
+                               e->x1 - output->x, e->y1 - output->y, box_width, box_height) < 0) {
+            error_code = WAKEFIELD_ERROR_INTERNAL;
+            continue;
+        }
+
+        for (int32_t row = 0; row < box_height; row++) {
+            convert(&target[row*stride], &output_pixels[(size_t)row*box_width*bpp], box_width);
+        }
+    }
+
+    int n_boxes;
+    const pixman_box32_t * const boxes = pixman_region32_rectangles(&uncovered, &n_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+        for (int32_t row = boxes[i].y1; row < boxes[i].y2; row++) {
+            memset(&memory[(row - y)*stride + (boxes[i].x1 - x)*sizeof(uint32_t)], 0,
+                   (boxes[i].x2 - boxes[i].x1)*sizeof(uint32_t));
+        }
+    }
+
+    pixman_region32_fini(&area_in_output);
+    pixman_region32_fini(&uncovered);
+
+    *pixels = (uint32_t *)memory;
+    return error_code;
+}
+
+/**
+ * Returns true iff the given area (in global coordinates) is not empty and intersects at least one output.
+ */
+static bool
+is_area_visible(struct wakefield *wakefield, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    if (width <= 0 || height <= 0 || (int64_t)x + width > INT32_MAX || (int64_t)y + height > INT32_MAX)
+        return false;
+
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        pixman_box32_t box = { x, y, x + width, y + height };
+        if (pixman_region32_contains_rectangle(&output->region, &box) != PIXMAN_REGION_OUT)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Returns true iff the given area (in global coordinates) is not empty and lies within
+ * the bounding box of all the outputs, which limits the memory a capture of it takes.
+ */
+static bool
+is_area_within_screen_extents(struct wakefield *wakefield, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+
+    int64_t x1 = INT64_MAX, y1 = INT64_MAX, x2 = INT64_MIN, y2 = INT64_MIN;
+    struct weston_output *output;
+    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
+        if (output->destroying)
+            continue;
+
+        x1 = MIN(x1, output->x);
+        y1 = MIN(y1, output->y);
+        x2 = MAX(x2, (int64_t)output->x + output->width);
+        y2 = MAX(y2, (int64_t)output->y + output->height);
+    }
+
+    return x >= x1 && y >= y1 && (int64_t)x + width <= x2 && (int64_t)y + height <= y2;
+}
+
+static void
+wakefield_get_region_hash(struct wl_client *client,
+                          struct wl_resource *resource,
+                          int32_t x,
+                          int32_t y,
+                          int32_t width,
+                          int32_t height,
+                          uint32_t flags)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: get_region_hash at (%d, %d) sized (%d, %d), flags 0x%x\n",
+                            x, y, width, height, flags);
+
+    if (!is_area_within_screen_extents(wakefield, x, y, width, height)
+        || !is_area_visible(wakefield, x, y, width, height)) {
+        wakefield_send_region_hash(resource, x, y, width, height, 0, 0, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    uint32_t *pixels;
+    uint64_t hash = 0;
+    const uint32_t error_code = read_area_into_scratch(wakefield, x, y, width, height, &pixels);
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        const size_t n_pixels = (size_t)width * height;
+        if (flags & WAKEFIELD_HASH_FLAGS_MASK_ALPHA) {
+            for (size_t i = 0; i < n_pixels; i++) {
+                pixels[i] &= 0x00ffffffu;
+            }
+        }
+        hash = wakefield_xxh64(pixels, n_pixels * sizeof(uint32_t), 0);
+    }
+    wakefield_scratch_done(&wakefield->scratch);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: region hash 0x%016lx, error %d\n", hash, error_code);
+
+    wakefield_send_region_hash(resource, x, y, width, height,
+                               (uint32_t)(hash >> 32), (uint32_t)hash, error_code);
+}
+
+/**
+ * Returns the wl_shm buffer of the given resource if it has a format that compare works with;
+ * otherwise returns NULL and sets error_code to a code from the wakefield error enum.
+ */
+static struct wl_shm_buffer *
+get_comparable_shm_buffer(struct wakefield *wakefield, struct wl_resource *buffer_resource, uint32_t *error_code)
+{
+    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
+    if (!buffer) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: buffer for comparison not from wl_shm\n");
+        *error_code = WAKEFIELD_ERROR_INTERNAL;
+        return NULL;
+    }
+
+    const uint32_t format = wl_shm_buffer_get_format(buffer);
+    if (format != WL_SHM_FORMAT_ARGB8888 && format != WL_SHM_FORMAT_XRGB8888) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: buffer for comparison has unsupported format %s\n",
+                                wakefield_shm_format_name(format));
+        *error_code = WAKEFIELD_ERROR_FORMAT;
+        return NULL;
+    }
+
+    return buffer;
+}
+
+static void
+wakefield_compare(struct wl_client *client,
+                  struct wl_resource *resource,
+                  struct wl_resource *reference_resource,
+                  int32_t x,
+                  int32_t y,
+                  uint32_t tolerance,
+                  struct wl_resource *diff_mask_resource)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    struct wl_shm_buffer *reference = get_comparable_shm_buffer(wakefield, reference_resource, &error_code);
+    struct wl_shm_buffer *diff_mask = NULL;
+    if (reference && diff_mask_resource) {
+        diff_mask = get_comparable_shm_buffer(wakefield, diff_mask_resource, &error_code);
+    }
+    if (error_code != WAKEFIELD_ERROR_NO_ERROR) {
+        wakefield_send_comparison(resource, reference_resource, 0, 0, 0, 0, 0, error_code);
+        return;
+    }
+
+    const int32_t width  = wl_shm_buffer_get_width(reference);
+    const int32_t height = wl_shm_buffer_get_height(reference);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: compare at (%d, %d) sized (%d, %d), tolerance %d%s\n",
+                            x, y, width, height, tolerance, diff_mask ? ", with diff mask" : "");
+
+    if (diff_mask && (wl_shm_buffer_get_width(diff_mask) != width
+                      || wl_shm_buffer_get_height(diff_mask) != height)) {
+        wakefield_send_comparison(resource, reference_resource, 0, 0, 0, 0, 0, WAKEFIELD_ERROR_SIZE);
+        return;
+    }
+
+    if (!is_area_within_screen_extents(wakefield, x, y, width, height)
+        || !is_area_visible(wakefield, x, y, width, height)) {
+        wakefield_send_comparison(resource, reference_resource, 0, 0, 0, 0, 0,
+                                  WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    uint32_t *pixels;
+    error_code = read_area_into_scratch(wakefield, x, y, width, height, &pixels);
+    if (error_code != WAKEFIELD_ERROR_NO_ERROR) {
+        wakefield_scratch_done(&wakefield->scratch);
+        wakefield_send_comparison(resource, reference_resource, 0, 0, 0, 0, 0, error_code);
+        return;
+    }
+
+    const wakefield_compare_row_func_t compare_row = wakefield_get_compare_row_func();
+    const uint8_t row_tolerance = MIN(tolerance, 0xffu);
+
+    uint32_t mismatches = 0;
+    pixman_box32_t bounds = { INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN };
+
+    wl_shm_buffer_begin_access(reference);
+    if (diff_mask) {
+        wl_shm_buffer_begin_access(diff_mask);
+    }
+    {
+        const uint8_t * const reference_data = wl_shm_buffer_get_data(reference);
+        const size_t reference_stride        = wl_shm_buffer_get_stride(reference);
+        uint8_t * const diff_mask_data       = diff_mask ? wl_shm_buffer_get_data(diff_mask) : NULL;
+        const size_t diff_mask_stride        = diff_mask ? wl_shm_buffer_get_stride(diff_mask) : 0;
+
+        for (int32_t row = 0; row < height; row++) {
+            uint32_t * const mask_row = diff_mask_data
+                                        ? (uint32_t *)&diff_mask_data[row*diff_mask_stride]
+                                        : NULL;
+            int32_t first, last;
+            const int32_t count = compare_row(&pixels[(size_t)row*width],
+                                              (const uint32_t *)&reference_data[row*reference_stride],
+                                              width, row_tolerance, mask_row, &first, &last);
+            if (count > 0) {
+                mismatches += count;
+                bounds.x1 = MIN(bounds.x1, first);
+                bounds.y1 = MIN(bounds.y1, row);
+                bounds.x2 = MAX(bounds.x2, last + 1);
+                bounds.y2 = row + 1;
+            }
+        }
+    }
+    if (diff_mask) {
+        wl_shm_buffer_end_access(diff_mask);
+    }
+    wl_shm_buffer_end_access(reference);
+
+    wakefield_scratch_done(&wakefield->scratch);
+
+    if (mismatches == 0) {
+        bounds = (pixman_box32_t) { 0, 0, 0, 0 };
+    }
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: %d pixel(s) mismatch within (%d, %d) sized (%d, %d)\n",
+                            mismatches, bounds.x1, bounds.y1, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1);
+
+    wakefield_send_comparison(resource, reference_resource, mismatches,
+                              bounds.x1, bounds.y1, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
+                              WAKEFIELD_ERROR_NO_ERROR);
+}
+
+static void
+send_region_stats(struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height,
+                  const struct wakefield_stats *stats, uint32_t error_code)
+{
+    struct wl_array histogram;
+    wl_array_init(&histogram);
+
+    uint32_t average = 0;
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        const uint64_t n_pixels = (uint64_t)width * height;
+        for (int c = 0; c < 3; c++) {
+            average |= (uint32_t)((stats->sum[c] + n_pixels / 2) / n_pixels) << (8*c);
+        }
+
+        uint32_t *bins = wl_array_add(&histogram, sizeof(stats->histogram));
+        if (bins) {
+            memcpy(bins, stats->histogram, sizeof(stats->histogram));
+        } else {
+            error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    wakefield_send_region_stats(resource, x, y, width, height,
+                                average, stats->min, stats->max, (uint32_t)stats->differing,
+                                &histogram, error_code);
+    wl_array_release(&histogram);
+}
+
+static void
+wakefield_get_region_stats(struct wl_client *client,
+                           struct wl_resource *resource,
+                           int32_t x,
+                           int32_t y,
+                           int32_t width,
+                           int32_t height,
+                           uint32_t rgb,
+                           uint32_t tolerance)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct wakefield_stats stats = WAKEFIELD_STATS_INITIALIZER;
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: get_region_stats at (%d, %d) sized (%d, %d), color 0x%06x (+/- %d)\n",
+                            x, y, width, height, rgb & 0x00ffffffu, tolerance);
+
+    if (width <= 0 || height <= 0 || !is_area_on_screen(wakefield, x, y, width, height)) {
+        send_region_stats(resource, x, y, width, height, &stats, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    uint32_t *pixels;
+    const uint32_t error_code = read_area_into_scratch(wakefield, x, y, width, height, &pixels);
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        const wakefield_stats_row_func_t stats_row = wakefield_get_stats_row_func();
+        for (int32_t row = 0; row < height; row++) {
+            stats_row(&pixels[(size_t)row*width], width, rgb & 0x00ffffffu, MIN(tolerance, 0xffu), &stats);
+        }
+    }
+    wakefield_scratch_done(&wakefield->scratch);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: region stats min 0x%06x, max 0x%06x, %ld pixel(s) differ, error %d\n",
+                            stats.min, stats.max, stats.differing, error_code);
+
+    send_region_stats(resource, x, y, width, height, &stats, error_code);
+}
+
+// The largest number of matches find_image reports; keeps the event well below the Wayland message size limit.
+#define WAKEFIELD_FIND_IMAGE_MAX_RESULTS 256
+
+/**
+ * An image searched for by find_image and the area it is searched in.
+ */
+struct wakefield_image_search {
+    const uint32_t *area;         // a8r8g8b8 pixels, rows area_width pixels apart
+    int32_t         area_width;
+    int32_t         area_height;
+    struct wl_shm_buffer *image_buffer; // that holds image
+    const uint8_t  *image;        // a8r8g8b8 or x8r8g8b8 pixels, rows image_stride bytes apart
+    size_t          image_stride;
+    int32_t         image_width;
+    int32_t         image_height;
+    uint8_t         tolerance;
+};
+
+/**
+ * Returns true iff the image of the given search matches the area at (x, y) in the area's coordinates.
+ */
+static bool
+image_matches_at(const struct wakefield_image_search *search, wakefield_compare_row_func_t compare_row,
+                 int32_t x, int32_t y)
+{
+    for (int32_t row = 0; row < search->image_height; row++) {
+        const uint32_t * const image_row = (const uint32_t *)&search->image[row*search->image_stride];
+        const uint32_t * const area_row  = &search->area[(size_t)(y + row)*search->area_width + x];
+
+        // Most positions don't match, usually within a few pixels, so an exact search stops
+        // at the first differing pixel instead of comparing entire rows.
+        if (search->tolerance == 0) {
+            for (int32_t i = 0; i < search->image_width; i++) {
+                if (((image_row[i] ^ area_row[i]) & 0x00ffffffu) != 0)
+                    return false;
+            }
+            continue;
+        }
+
+        int32_t first, last;
+        if (compare_row(area_row, image_row, search->image_width, search->tolerance, NULL, &first, &last) > 0)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Searches the rows [y_from, y_to) of the positions of the image in the area of the given search
+ * and appends the matches (in the area's coordinates) to the given array of wakefield_point
+ * until it has max_results of them.
+ *
+ * @return false iff the array could not be grown.
+ */
+static bool
+find_image_in_rows(const struct wakefield_image_search *search, int32_t y_from, int32_t y_to,
+                   struct wl_array *matches, size_t max_results)
+{
+    const wakefield_compare_row_func_t compare_row = wakefield_get_compare_row_func();
+    const int32_t x_to = search->area_width - search->image_width + 1;
+
+    for (int32_t y = y_from; y < y_to; y++) {
+        for (int32_t x = 0; x < x_to; x++) {
+            if (matches->size / sizeof(struct wakefield_point) >= max_results)
+                return true;
+
+            if (image_matches_at(search, compare_row, x, y)) {
+                struct wakefield_point *match = wl_array_add(matches, sizeof(struct wakefield_point));
+                if (match == NULL)
+                    return false;
+
+                match->x = x;
+                match->y = y;
             }
         }
     }
 
-    pixman_region32_fini(&region_in_output);
+    return true;
+}
 
-    return area;
+/**
+ * A share of the positions of the image that one job searches.
+ */
+struct wakefield_image_search_job {
+    const struct wakefield_image_search *search;
+    int32_t         y_from;
+    int32_t         y_to;
+    size_t          max_results;
+    struct wl_array matches;    // wakefield_point
+    bool            ok;
+};
+
+static void
+image_search_job(void *data, int index)
+{
+    struct wakefield_image_search_job *job = &((struct wakefield_image_search_job *)data)[index];
+
+    // The protection from the client truncating the buffer is per thread.
+    wl_shm_buffer_begin_access(job->search->image_buffer);
+    {
+        job->ok = find_image_in_rows(job->search, job->y_from, job->y_to, &job->matches, job->max_results);
+    }
+    wl_shm_buffer_end_access(job->search->image_buffer);
+}
+
+/**
+ * Same as find_image_in_rows() for all the positions, but splits them into bands of rows
+ * that the worker threads search in parallel.
+ */
+static bool
+find_image_in_parallel(struct wakefield *wakefield, const struct wakefield_image_search *search,
+                       struct wl_array *matches, size_t max_results)
+{
+    const int32_t n_rows = search->area_height - search->image_height + 1;
+    const int     n_jobs = MIN(n_rows, 2 * (wakefield->workers.n_threads + 1));
+    if (wakefield->workers.n_threads == 0 || n_jobs <= 1) {
+        return find_image_in_rows(search, 0, n_rows, matches, max_results);
+    }
+
+    struct wakefield_image_search_job *jobs = calloc(n_jobs, sizeof(struct wakefield_image_search_job));
+    if (jobs == NULL)
+        return false;
+
+    for (int i = 0; i < n_jobs; i++) {
+        jobs[i].search      = search;
+        jobs[i].y_from      = (int32_t)((int64_t)n_rows * i / n_jobs);
+        jobs[i].y_to        = (int32_t)((int64_t)n_rows * (i + 1) / n_jobs);
+        jobs[i].max_results = max_results;
+        wl_array_init(&jobs[i].matches);
+    }
+
+    wakefield_workers_run(&wakefield->workers, image_search_job, jobs, n_jobs);
+
+    // The bands are in the order of rows, so the first max_results matches of all of them are the answer.
+    bool ok = true;
+    for (int i = 0; i < n_jobs; i++) {
+        ok = ok && jobs[i].ok;
+        const size_t n_matches = MIN(jobs[i].matches.size / sizeof(struct wakefield_point),
+                                     max_results - matches->size / sizeof(struct wakefield_point));
+        if (ok && n_matches > 0) {
+            void *dst = wl_array_add(matches, n_matches * sizeof(struct wakefield_point));
+            if (dst) {
+                memcpy(dst, jobs[i].matches.data, n_matches * sizeof(struct wakefield_point));
+            } else {
+                ok = false;
+            }
+        }
+        wl_array_release(&jobs[i].matches);
+    }
+    free(jobs);
+
+    return ok;
+}
+
+static void
+wakefield_find_image(struct wl_client *client,
+                     struct wl_resource *resource,
+                     struct wl_resource *image_resource,
+                     int32_t x,
+                     int32_t y,
+                     int32_t width,
+                     int32_t height,
+                     uint32_t tolerance,
+                     uint32_t max_results)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wl_array matches;
+    wl_array_init(&matches);
+
+    uint32_t error_code = WAKEFIELD_ERROR_NO_ERROR;
+    struct wl_shm_buffer *image = get_comparable_shm_buffer(wakefield, image_resource, &error_code);
+    if (image == NULL) {
+        wakefield_send_image_found(resource, image_resource, &matches, error_code);
+        return;
+    }
+
+    struct wakefield_image_search search = {
+            .area_width   = width,
+            .area_height  = height,
+            .image_buffer = image,
+            .image_stride = wl_shm_buffer_get_stride(image),
+            .image_width  = wl_shm_buffer_get_width(image),
+            .image_height = wl_shm_buffer_get_height(image),
+            .tolerance    = MIN(tolerance, 0xffu)
+    };
+
+    if (max_results == 0 || max_results > WAKEFIELD_FIND_IMAGE_MAX_RESULTS) {
+        max_results = WAKEFIELD_FIND_IMAGE_MAX_RESULTS;
+    }
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: find_image sized (%d, %d) at (%d, %d) sized (%d, %d), "
+                            "tolerance %d, up to %d result(s)\n",
+                            search.image_width, search.image_height, x, y, width, height,
+                            tolerance, max_results);
+
+    if (!is_area_within_screen_extents(wakefield, x, y, width, height)
+        || !is_area_visible(wakefield, x, y, width, height)) {
+        wakefield_send_image_found(resource, image_resource, &matches, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    if (search.image_width <= 0 || search.image_height <= 0
+        || search.image_width > width || search.image_height > height) {
+        // Nothing can match
+        wakefield_send_image_found(resource, image_resource, &matches, WAKEFIELD_ERROR_NO_ERROR);
+        return;
+    }
+
+    uint32_t *pixels;
+    error_code = read_area_into_scratch(wakefield, x, y, width, height, &pixels);
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        search.area = pixels;
+        wl_shm_buffer_begin_access(image);
+        {
+            search.image = wl_shm_buffer_get_data(image);
+            if (!find_image_in_parallel(wakefield, &search, &matches, max_results)) {
+                error_code = WAKEFIELD_ERROR_OUT_OF_MEMORY;
+            }
+        }
+        wl_shm_buffer_end_access(image);
+    }
+    wakefield_scratch_done(&wakefield->scratch);
+
+    // Report the matches in absolute coordinates
+    struct wakefield_point *match;
+    wl_array_for_each(match, &matches) {
+        match->x += x;
+        match->y += y;
+    }
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: found %ld match(es), error %d\n",
+                            matches.size / sizeof(struct wakefield_point), error_code);
+
+    wakefield_send_image_found(resource, image_resource, &matches, error_code);
+    wl_array_release(&matches);
+}
+
+static void
+screencast_buffer_destroy(struct wakefield_screencast_buffer *buffer)
+{
+    wl_list_remove(&buffer->link);
+    wl_list_remove(&buffer->destroy_listener.link);
+    free(buffer);
+}
+
+static void
+screencast_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+    struct wakefield_screencast_buffer *buffer = container_of(listener, struct wakefield_screencast_buffer,
+                                                              destroy_listener);
+    screencast_buffer_destroy(buffer);
+}
+
+/**
+ * Returns the number of milliseconds from a to b.
+ */
+static int64_t
+timespec_sub_to_msec(const struct timespec *b, const struct timespec *a)
+{
+    return (int64_t)(b->tv_sec - a->tv_sec) * 1000 + (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+static void
+screencast_send_frame(struct wakefield_screencast *screencast, struct wl_resource *buffer_resource,
+                      uint32_t error_code)
+{
+    const uint64_t tv_sec = screencast->sequence_time.tv_sec;
+    wakefield_screencast_send_frame(screencast->resource, buffer_resource, screencast->sequence,
+                                    (uint32_t)(tv_sec >> 32), (uint32_t)tv_sec,
+                                    (uint32_t)screencast->sequence_time.tv_nsec, error_code);
+}
+
+/**
+ * Fills the oldest queued buffer of the given screencast and hands it back to the client
+ * if the area was repainted since the last frame and the frame rate limit allows.
+ */
+static void
+screencast_try_frame(struct wakefield_screencast *screencast)
+{
+    struct wakefield *wakefield = screencast->wakefield;
+
+    if (!screencast->dirty || wl_list_empty(&screencast->buffer_list))
+        return;
+
+    struct timespec now;
+    weston_compositor_read_presentation_clock(wakefield->compositor, &now);
+    if (screencast->frame_interval > 0) {
+        const int64_t since_last_frame = timespec_sub_to_msec(&now, &screencast->frame_time);
+        if (since_last_frame < screencast->frame_interval) {
+            wl_event_source_timer_update(screencast->timer, screencast->frame_interval - since_last_frame);
+            return;
+        }
+    }
+
+    struct wakefield_screencast_buffer *buffer = container_of(screencast->buffer_list.next,
+                                                              struct wakefield_screencast_buffer, link);
+    struct wl_resource *buffer_resource = buffer->resource;
+    screencast_buffer_destroy(buffer);
+
+    pixman_region32_t area;
+    pixman_region32_init_rect(&area, screencast->x, screencast->y, screencast->width, screencast->height);
+    const uint32_t error_code = read_region_into_buffer(wakefield, wl_shm_buffer_get(buffer_resource),
+                                                        screencast->x, screencast->y, &area);
+    pixman_region32_fini(&area);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: screencast at (%d, %d) sent frame %d, error %d\n",
+                            screencast->x, screencast->y, screencast->sequence, error_code);
+
+    screencast->dirty      = false;
+    screencast->frame_time = now;
+    screencast_send_frame(screencast, buffer_resource, error_code);
+}
+
+/**
+ * Advances the sequence of every screencast whose area intersects the given damage (in global
+ * coordinates) and sends them new frames if they have buffers to fill.
+ */
+static void
+damage_screencasts(struct wakefield *wakefield, pixman_region32_t *damage)
+{
+    struct wakefield_screencast *screencast;
+    wl_list_for_each(screencast, &wakefield->screencast_list, link) {
+        pixman_box32_t box = {
+                screencast->x, screencast->y,
+                screencast->x + screencast->width, screencast->y + screencast->height
+        };
+        if (screencast->width == 0
+            || pixman_region32_contains_rectangle(damage, &box) == PIXMAN_REGION_OUT)
+            continue;
+
+        screencast->sequence++;
+        screencast->dirty = true;
+        // The frame signal comes right after rendering; the frame is shown at the next vblank or so.
+        weston_compositor_read_presentation_clock(wakefield->compositor, &screencast->sequence_time);
+        screencast_try_frame(screencast);
+    }
+}
+
+static int
+screencast_timer_notify(void *data)
+{
+    struct wakefield_screencast *screencast = data;
+
+    screencast_try_frame(screencast);
+    return 0;
+}
+
+static void
+screencast_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void
+screencast_handle_queue_buffer(struct wl_client *client, struct wl_resource *resource,
+                               struct wl_resource *buffer_resource)
+{
+    struct wakefield_screencast *screencast = wl_resource_get_user_data(resource);
+    struct wakefield *wakefield = screencast->wakefield;
+
+    struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(buffer_resource);
+    if (shm_buffer == NULL) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: buffer for screencast not from wl_shm\n");
+        screencast_send_frame(screencast, buffer_resource, WAKEFIELD_ERROR_INTERNAL);
+        return;
+    }
+
+    const uint32_t format = wl_shm_buffer_get_format(shm_buffer);
+    const int32_t  width  = wl_shm_buffer_get_width(shm_buffer);
+    const int32_t  height = wl_shm_buffer_get_height(shm_buffer);
+    if (!is_buffer_format_supported(wakefield, format)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: buffer for screencast has unsupported format %d, "
+                                "check codes in enum 'format' in wayland.xml\n",
+                                format);
+        screencast_send_frame(screencast, buffer_resource, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+
+    if (screencast->width == 0) {
+        screencast->width  = width;
+        screencast->height = height;
+        screencast->format = format;
+    } else if (width != screencast->width || height != screencast->height || format != screencast->format) {
+        screencast_send_frame(screencast, buffer_resource, WAKEFIELD_ERROR_SIZE);
+        return;
+    }
+
+    struct wakefield_screencast_buffer *buffer = zalloc(sizeof(struct wakefield_screencast_buffer));
+    if (buffer == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    buffer->screencast = screencast;
+    buffer->resource   = buffer_resource;
+    buffer->destroy_listener.notify = screencast_buffer_destroyed;
+    wl_resource_add_destroy_listener(buffer_resource, &buffer->destroy_listener);
+    wl_list_insert(screencast->buffer_list.prev, &buffer->link);
+
+    screencast_try_frame(screencast);
+}
+
+static const struct wakefield_screencast_interface wakefield_screencast_implementation = {
+        .destroy = screencast_handle_destroy,
+        .queue_buffer = screencast_handle_queue_buffer
+};
+
+static void
+screencast_resource_destroy(struct wl_resource *resource)
+{
+    struct wakefield_screencast *screencast = wl_resource_get_user_data(resource);
+
+    struct wakefield_screencast_buffer *buffer, *tmp;
+    wl_list_for_each_safe(buffer, tmp, &screencast->buffer_list, link) {
+        screencast_buffer_destroy(buffer);
+    }
+    wl_list_remove(&screencast->link);
+    if (screencast->timer) {
+        wl_event_source_remove(screencast->timer);
+    }
+    free(screencast);
+}
+
+static void
+wakefield_create_screencast(struct wl_client *client,
+                            struct wl_resource *resource,
+                            uint32_t id,
+                            int32_t x,
+                            int32_t y,
+                            uint32_t max_fps)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    struct wakefield_screencast *screencast = zalloc(sizeof(struct wakefield_screencast));
+    if (screencast == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    struct wl_event_loop *loop = wl_display_get_event_loop(wakefield->compositor->wl_display);
+    screencast->timer = wl_event_loop_add_timer(loop, screencast_timer_notify, screencast);
+    screencast->resource = wl_resource_create(client, &wakefield_screencast_interface,
+                                              wl_resource_get_version(resource), id);
+    if (screencast->resource == NULL || screencast->timer == NULL) {
+        if (screencast->resource) {
+            wl_resource_destroy(screencast->resource);
+        }
+        if (screencast->timer) {
+            wl_event_source_remove(screencast->timer);
+        }
+        free(screencast);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    screencast->wakefield      = wakefield;
+    screencast->x              = x;
+    screencast->y              = y;
+    screencast->frame_interval = max_fps > 0 ? MAX(1000 / max_fps, 1) : 0;
+    screencast->dirty          = true; // the first frame shows the area as it is now
+    weston_compositor_read_presentation_clock(wakefield->compositor, &screencast->sequence_time);
+    wl_list_init(&screencast->buffer_list);
+    wl_list_insert(&wakefield->screencast_list, &screencast->link);
+
+    wl_resource_set_implementation(screencast->resource, &wakefield_screencast_implementation,
+                                   screencast, screencast_resource_destroy);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: created screencast at (%d, %d), up to %d fps\n",
+                            x, y, max_fps);
+}
+
+static void
+compressed_capture_done(struct wakefield_encode_job *job, void *data)
+{
+    struct wakefield *wakefield = data;
+    struct wakefield_compressed_capture *capture = container_of(job, struct wakefield_compressed_capture, job);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: compressed capture %u encoded into %ld bytes%s\n",
+                            capture->serial, job->size, job->ok ? "" : ", failed");
+
+    if (capture->resource) {
+        wakefield_send_compressed_capture_ready(capture->resource, capture->serial, job->size,
+                                                job->ok ? WAKEFIELD_ERROR_NO_ERROR : WAKEFIELD_ERROR_INTERNAL);
+    }
+
+    wl_list_remove(&capture->link);
+    free(capture);
+}
+
+static void
+wakefield_capture_compressed(struct wl_client *client,
+                             struct wl_resource *resource,
+                             int32_t fd,
+                             int32_t x,
+                             int32_t y,
+                             int32_t width,
+                             int32_t height,
+                             uint32_t codec,
+                             uint32_t serial)
+{
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+
+    weston_log_scope_printf(wakefield->log,
+                            "WAKEFIELD: capture_compressed %u at (%d, %d) sized (%d, %d), codec %d\n",
+                            serial, x, y, width, height, codec);
+
+    if (!wakefield_codec_supported(codec)) {
+        close(fd);
+        wakefield_send_compressed_capture_ready(resource, serial, 0, WAKEFIELD_ERROR_FORMAT);
+        return;
+    }
+
+    if (!is_area_within_screen_extents(wakefield, x, y, width, height)) {
+        close(fd);
+        wakefield_send_compressed_capture_ready(resource, serial, 0, WAKEFIELD_ERROR_INVALID_COORDINATES);
+        return;
+    }
+
+    // The encoder thread writes with blocking write(); a pipe or a socket that nobody drains
+    // would stall it, and every compressed capture after this one, for good.
+    struct stat fd_stat;
+    if (fstat(fd, &fd_stat) < 0 || !S_ISREG(fd_stat.st_mode)) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: capture_compressed %u needs a regular file or a memfd\n", serial);
+        close(fd);
+        wakefield_send_compressed_capture_ready(resource, serial, 0, WAKEFIELD_ERROR_INTERNAL);
+        return;
+    }
+
+    // The pixels must outlive the scratch memory, which the next request reuses.
+    const size_t size = (size_t)width * height * sizeof(uint32_t);
+    struct wakefield_compressed_capture *capture = zalloc(sizeof(struct wakefield_compressed_capture));
+    uint32_t *pixels = malloc(size);
+    if (capture == NULL || pixels == NULL) {
+        free(capture);
+        free(pixels);
+        close(fd);
+        wakefield_send_compressed_capture_ready(resource, serial, 0, WAKEFIELD_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+
+    uint32_t *area;
+    const uint32_t error_code = read_area_into_scratch(wakefield, x, y, width, height, &area);
+    if (error_code == WAKEFIELD_ERROR_NO_ERROR) {
+        memcpy(pixels, area, size);
+    }
+    wakefield_scratch_done(&wakefield->scratch);
+
+    if (error_code != WAKEFIELD_ERROR_NO_ERROR) {
+        free(capture);
+        free(pixels);
+        close(fd);
+        wakefield_send_compressed_capture_ready(resource, serial, 0, error_code);
+        return;
+    }
+
+    capture->job.codec  = codec;
+    capture->job.pixels = pixels;
+    capture->job.width  = width;
+    capture->job.height = height;
+    capture->job.fd     = fd;
+    capture->resource   = resource;
+    capture->serial     = serial;
+    wl_list_insert(&wakefield->compressed_capture_list, &capture->link);
+
+    wakefield_encoder_submit(&wakefield->encoder, &capture->job);
+}
+
+static void
+wakefield_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
 }
 
-/**
- * Sets every pixel in the given buffer to 0.
- */
+static const struct wakefield_interface wakefield_implementation = {
+        .destroy = wakefield_handle_destroy,
+        .get_surface_location = wakefield_get_surface_location,
+        .move_surface = wakefield_move_surface,
+        .get_pixel_color = wakefield_get_pixel_color,
+        .capture_create = wakefield_capture_create,
+        .get_pixel_colors = wakefield_get_pixel_colors,
+        .capture_create_after_repaint = wakefield_capture_create_after_repaint,
+        .create_capture = wakefield_create_capture,
+        .wait_for_color = wakefield_wait_for_color,
+        .get_region_hash = wakefield_get_region_hash,
+        .compare = wakefield_compare,
+        .get_region_stats = wakefield_get_region_stats,
+        .find_image = wakefield_find_image,
+        .create_screencast = wakefield_create_screencast,
+        .capture_compressed = wakefield_capture_compressed,
+        .create_layout = wakefield_create_layout,
+        .watch_surface = wakefield_watch_surface,
+        .get_surfaces = wakefield_get_surfaces,
+        .capture_surface = wakefield_capture_surface,
+        .create_sync = wakefield_create_sync,
+        .step = wakefield_step
+};
+
 static void
-clear_buffer(struct wl_shm_buffer *buffer)
+wakefield_resource_destroy(struct wl_resource *resource)
 {
-    const int32_t  height           = wl_shm_buffer_get_height(buffer);
-    const size_t   stride           = wl_shm_buffer_get_stride(buffer);
-    const size_t   buffer_byte_size = height*stride;
+    struct wakefield *wakefield = wl_resource_get_user_data(resource);
 
-    wl_shm_buffer_begin_access(buffer);
-    {
-        uint32_t *data = wl_shm_buffer_get_data(buffer);
-        memset(data, 0, buffer_byte_size);
+    struct wakefield_pending_capture *capture, *tmp;
+    wl_list_for_each_safe(capture, tmp, &wakefield->pending_capture_list, link) {
+        if (capture->resource == resource) {
+            pending_capture_destroy(capture);
+        }
+    }
+
+    // The images being encoded are still written out, but there's no one to tell about it.
+    struct wakefield_compressed_capture *compressed_capture;
+    wl_list_for_each(compressed_capture, &wakefield->compressed_capture_list, link) {
+        if (compressed_capture->resource == resource) {
+            compressed_capture->resource = NULL;
+        }
     }
-    wl_shm_buffer_end_access(buffer);
 }
 
-/**
- * Copies 4-byte pixels from the given array to the given buffer
- * at the given offset into the buffer.
- *
- * @param buffer   target buffer (format is assumed to be 4 byte per pixel)
- * @param data     array of 4-byte pixels of size (width*height)
- * @param target_x horizontal coordinate of the top-left corner in the buffer
- *                 where the given data should be placed
- * @param target_y vertical coordinate of the top-left corner in the buffer
- *                 where the given data should be placed
- * @param width    the source image width in pixels
- * @param height   the source image height in pixels
- */
 static void
-copy_pixels_to_shm_buffer(struct wl_shm_buffer *buffer, uint32_t *data,
-                          int32_t target_x, int32_t target_y,
-                          int32_t width, int32_t height)
+wakefield_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
 {
-    assert (target_x >= 0 && target_y >= 0);
-    assert (data);
-
-    const int32_t buffer_width = wl_shm_buffer_get_width(buffer);
-
-    wl_shm_buffer_begin_access(buffer);
-    {
-        uint32_t * const buffer_data = wl_shm_buffer_get_data(buffer);
-        assert (buffer_data);
+    struct wakefield *wakefield = data;
 
-        for (int32_t y = 0; y < height; y++) {
-            const uint32_t * const src_line = &data[y*width];
-            uint32_t * const       dst_line = &buffer_data[(target_y + y)*buffer_width];
-            for (int32_t x = 0; x < width; x++) {
-                dst_line[target_x + x] = src_line[x];
-            }
-        }
+    struct wl_resource *resource = wl_resource_create(client, &wakefield_interface,
+                                                      MIN(version, WAKEFIELD_VERSION), id);
+    if (resource) {
+        wl_resource_set_implementation(resource, &wakefield_implementation, wakefield,
+                                       wakefield_resource_destroy);
     }
-    wl_shm_buffer_end_access(buffer);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: bind\n");
 }
 
 /**
- * Verifies that the given buffer format is supported and sends the "capture ready" event
- * with the appropriate error code if it wasn't.
+ * Returns the time since the recording started in nanoseconds.
  */
-static bool
-check_buffer_format_supported(struct wakefield *wakefield, struct wl_resource *resource,
-                              struct wl_resource *buffer_resource, uint32_t buffer_format)
+static uint64_t
+record_time(struct wakefield *wakefield)
 {
-    if (buffer_format != WL_SHM_FORMAT_ARGB8888
-        && buffer_format != WL_SHM_FORMAT_XRGB8888) {
-        weston_log_scope_printf(wakefield->log,
-                                "WAKEFIELD: buffer for image capture has unsupported format %d, "
-                                "check codes in enum 'format' in wayland.xml\n",
-                                buffer_format);
-        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_FORMAT);
-        return false;
-    }
+    struct timespec now;
+    weston_compositor_read_presentation_clock(wakefield->compositor, &now);
+    return (int64_t)(now.tv_sec - wakefield->record_start.tv_sec) * 1000000000
+           + (now.tv_nsec - wakefield->record_start.tv_nsec);
+}
 
-    return true;
+static void
+record_stop(struct wakefield *wakefield)
+{
+    if (wakefield->request_logger) {
+        wl_protocol_logger_destroy(wakefield->request_logger);
+        wakefield->request_logger = NULL;
+    }
+    wakefield_record_close(&wakefield->recorder);
 }
 
 /**
- * Verifies that the given buffer type is shm and sends the "capture ready" event
- * with the appropriate error code if it wasn't.
+ * Stops the recording if writing it has failed, so that the disk doesn't fill up any further.
+ * The request logger stays, but has nothing to write to; it can't be removed from within itself.
  */
-static bool
-check_buffer_type_supported(struct wakefield *wakefield, struct wl_resource *resource,
-                            struct wl_resource *buffer_resource)
+static void
+record_check_failed(struct wakefield *wakefield)
 {
-    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
-
-    if (!buffer) {
-        weston_log_scope_printf(wakefield->log, "WAKEFIELD: buffer for image capture not from wl_shm\n");
-        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_INTERNAL);
-        return false;
+    if (wakefield->recorder.failed) {
+        weston_log("wakefield: failed to write the recording into %s, stopped recording\n",
+                   wakefield->record_path);
+        wakefield_record_close(&wakefield->recorder);
     }
-
-    return true;
 }
 
 /**
- * Verifies that the given capture area is not empty and sends the successful "capture ready" event
- * if it was.
+ * Checks if the output is among those given with --wakefield-record-outputs.
  */
 static bool
-capture_is_empty(struct wakefield *wakefield, struct wl_resource *resource,
-                    struct wl_resource *buffer_resource, uint64_t largest_capture_area)
+is_output_recorded(struct wakefield *wakefield, struct weston_output *output)
 {
-    if (largest_capture_area == 0) {
-        // All outputs might've just disappeared
-        weston_log_scope_printf(wakefield->log,
-                                "WAKEFIELD: captured area size on all outputs is zero.\n");
-        wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_NO_ERROR);
+    if (wakefield->record_outputs == NULL)
         return true;
+
+    const size_t name_length = strlen(output->name);
+    const char *name = wakefield->record_outputs;
+    while (*name) {
+        const size_t length = strcspn(name, ",");
+        if (length == name_length && strncmp(name, output->name, length) == 0)
+            return true;
+
+        name += length;
+        if (*name == ',')
+            name++;
     }
 
     return false;
 }
 
+/**
+ * Adds the parts of the output that have just been repainted to the recording.
+ * The entire output is recorded instead every record_keyframe_interval frames
+ * and whenever the output has been moved or resized.
+ */
 static void
-wakefield_capture_create(struct wl_client *client,
-                         struct wl_resource *resource,
-                         struct wl_resource *buffer_resource,
-                         int32_t x,
-                         int32_t y)
+record_frame(struct wakefield_output *wo, pixman_region32_t *damage)
 {
-    struct wakefield *wakefield = wl_resource_get_user_data(resource);
+    struct wakefield     *wakefield = wo->wakefield;
+    struct weston_output *output    = wo->output;
 
-    if (!check_buffer_type_supported(wakefield, resource, buffer_resource)) {
+    if (wakefield->recorder.file == NULL || !is_output_recorded(wakefield, output))
         return;
-    }
 
-    struct wl_shm_buffer *buffer = wl_shm_buffer_get(buffer_resource);
-    assert (buffer); // actually, verified earlier
-    const uint32_t buffer_format = wl_shm_buffer_get_format(buffer);
-    if (!check_buffer_format_supported(wakefield, resource, buffer_resource, buffer_format)) {
+    const pixman_format_code_t read_format = wakefield->compositor->read_format;
+    const size_t bpp = PIXMAN_FORMAT_BPP(read_format) / 8; // byte-per-pixel
+
+    const wakefield_convert_row_func_t convert = wakefield_get_convert_row_func(read_format,
+                                                                                WL_SHM_FORMAT_ARGB8888);
+    if (convert == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: compositor pixel format %d (see pixman.h) not supported\n",
+                                read_format);
         return;
     }
 
-    clear_buffer(buffer); // in case some outputs disappear mid-flight or a part of the capture is out of screen
-
-    const int32_t width  = wl_shm_buffer_get_width(buffer);
-    const int32_t height = wl_shm_buffer_get_height(buffer);
+    const uint64_t time = record_time(wakefield);
+    const pixman_box32_t output_box = { output->x, output->y,
+                                        output->x + output->width, output->y + output->height };
+    bool keyframe = wo->frames_since_keyframe + 1 >= wakefield->record_keyframe_interval;
+    if (!wo->recorded || memcmp(&output_box, &wo->recorded_box, sizeof(output_box)) != 0) {
+        wakefield_record_write_output(&wakefield->recorder, time, output->id,
+                                      output->x, output->y, output->width, output->height, output->name);
+        wo->recorded     = true;
+        wo->recorded_box = output_box;
+        keyframe         = true;
+    }
 
-    pixman_region32_t region_global;    // capture region in global coordinates
-    pixman_region32_t region_in_output; // capture region in a particular output in that output's coordinates
+    pixman_region32_t region;
+    if (keyframe) {
+        pixman_region32_init_rect(&region, output->x, output->y, output->width, output->height);
+    } else {
+        pixman_region32_init(&region);
+        pixman_region32_intersect(&region, damage, &output->region);
+    }
 
-    pixman_region32_init_rect(&region_global, x, y, width, height);
-    pixman_region32_init(&region_in_output);
+    int n_boxes;
+    const pixman_box32_t * const boxes = pixman_region32_rectangles(&region, &n_boxes);
+    size_t max_box_pixels = 0;
+    for (int i = 0; i < n_boxes; i++) {
+        max_box_pixels = MAX(max_box_pixels, (size_t)(boxes[i].x2 - boxes[i].x1) * (boxes[i].y2 - boxes[i].y1));
+    }
 
-    bool fits_entirely;
-    const uint64_t largest_capture_area = get_largest_area_in_one_output(wakefield->compositor, &region_global, &fits_entirely);
-    if (capture_is_empty(wakefield, resource, buffer_resource, largest_capture_area)) {
+    // The converted pixels of a box occupy the first part of the scratch memory,
+    // the pixels in the compositor's format the last part.
+    uint8_t * const memory = n_boxes > 0
+                             ? wakefield_scratch_get(&wakefield->scratch, max_box_pixels * (sizeof(uint32_t) + bpp))
+                             : NULL;
+    if (n_boxes == 0 || memory == NULL) {
+        if (n_boxes > 0) {
+            weston_log_scope_printf(wakefield->log,
+                                    "WAKEFIELD: failed to allocate %ld bytes for recording a frame.\n",
+                                    max_box_pixels * (sizeof(uint32_t) + bpp));
+        }
+        pixman_region32_fini(&region);
         return;
     }
+    uint32_t * const pixels = (uint32_t *)memory;
+    uint8_t  * const output_pixels = &memory[max_box_pixels * sizeof(uint32_t)];
 
-    const size_t bpp = 4; // byte-per-pixel
-    void *per_output_buffer = NULL;
-    if (!fits_entirely) {
-        // Can't read screen pixels directly into the resulting buffer, have to use an intermediate storage.
-        per_output_buffer = malloc(largest_capture_area * bpp);
-        if (per_output_buffer == NULL) {
-            weston_log_scope_printf(wakefield->log,
-                                    "WAKEFIELD: failed to allocate %ld bytes for temporary capture buffer.\n",
-                                    largest_capture_area);
-            wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_OUT_OF_MEMORY);
-            return;
+    wakefield_record_begin_frame(&wakefield->recorder, time, output->id,
+                                 keyframe ? WAKEFIELD_RECORD_FRAME_KEYFRAME : 0, n_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+        const int32_t width  = boxes[i].x2 - boxes[i].x1;
+        const int32_t height = boxes[i].y2 - boxes[i].y1;
+        const int32_t x      = boxes[i].x1 - output->x;
+        const int32_t y      = boxes[i].y1 - output->y;
+
+        if (pixman_formats_compatible(read_format, PIXMAN_a8r8g8b8)) {
+            if (read_output_pixels(wakefield, output, read_format, pixels, x, y, width, height) < 0) {
+                memset(pixels, 0, (size_t)width * height * sizeof(uint32_t));
+            }
+        } else if (read_output_pixels(wakefield, output, read_format, output_pixels, x, y, width, height) < 0) {
+            memset(pixels, 0, (size_t)width * height * sizeof(uint32_t));
+        } else {
+            for (int32_t row = 0; row < height; row++) {
+                convert(&pixels[(size_t)row*width], &output_pixels[(size_t)row*width*bpp], width);
+            }
         }
+
+        wakefield_record_add_box(&wakefield->recorder, x, y, width, height, pixels);
     }
+    wakefield_record_end_frame(&wakefield->recorder);
 
-    const pixman_format_code_t buffer_format_pixman = wl_shm_format_to_pixman(buffer_format);
-    struct weston_output *output;
-    wl_list_for_each(output, &wakefield->compositor->output_list, link) {
-        if (output->destroying)
-            continue;
+    // Whatever follows the last keyframe is lost if the compositor crashes.
+    if (keyframe) {
+        fflush(wakefield->recorder.file);
+        wo->frames_since_keyframe = 0;
+    } else {
+        wo->frames_since_keyframe++;
+    }
 
-        pixman_region32_intersect(&region_in_output, &region_global, &output->region);
-        if (pixman_region32_not_empty(&region_in_output)) {
-            const pixman_box32_t * const e = pixman_region32_extents(&region_in_output);
+    wakefield_scratch_done(&wakefield->scratch);
+    pixman_region32_fini(&region);
+    record_check_failed(wakefield);
+}
+
+/**
+ * Describes an output that has been removed with a width and height of 0 in the recording,
+ * so that its id can be reused by a new output.
+ */
+static void
+record_output_removed(struct wakefield_output *wo)
+{
+    struct wakefield *wakefield = wo->wakefield;
 
-            const int32_t region_x_in_global = e->x1;
-            const int32_t region_y_in_global = e->y1;
-            const int32_t width_in_output    = e->x2 - e->x1;
-            const int32_t height_in_output   = e->y2 - e->y1;
-            weston_log_scope_printf(wakefield->log, "WAKEFIELD: output '%s' has a chunk of the image at (%d, %d) sized (%d, %d)\n",
-                                    output->name,
-                                    e->x1, e->y1,
-                                    width_in_output, height_in_output);
+    if (wakefield->recorder.file == NULL || !wo->recorded)
+        return;
+
+    wakefield_record_write_output(&wakefield->recorder, record_time(wakefield), wo->output->id,
+                                  0, 0, 0, 0, wo->output->name);
+    fflush(wakefield->recorder.file);
+    wo->recorded = false;
+    record_check_failed(wakefield);
+}
 
-            // Better, but not available in the current libweston:
-            // weston_output_region_from_global(output, &region_in_output);
+static void
+append_text(char *text, size_t size, size_t *length, const char *format, ...)
+{
+    if (*length >= size - 1)
+        return;
 
-            // Now convert region_in_output from global to output-local coordinates.
-            pixman_region32_translate(&region_in_output, -output->x, -output->y);
+    va_list args;
+    va_start(args, format);
+    const int n = vsnprintf(&text[*length], size - *length, format, args);
+    va_end(args);
 
-            const pixman_box32_t * const e_in_output = pixman_region32_extents(&region_in_output);
-            const int32_t x_in_output = e_in_output->x1;
-            const int32_t y_in_output = e_in_output->y1;
+    if (n > 0) {
+        *length = MIN(*length + n, size - 1);
+    }
+}
 
-            weston_log_scope_printf(wakefield->log,
-                                    "WAKEFIELD: grabbing pixels at (%d, %d) of size %dx%d, format %s\n",
-                                    x_in_output, y_in_output,
-                                    width_in_output, height_in_output,
-                                    buffer_format_pixman == PIXMAN_a8r8g8b8 ? "ARGB8888" : "XRGB8888");
-
-            if (per_output_buffer) {
-                wakefield->compositor->renderer->read_pixels(output,
-                                                             buffer_format_pixman, // TODO: may not work with all renderers, check screenshooter_frame_notify() in libweston
-                                                             per_output_buffer,
-                                                             x_in_output, y_in_output,
-                                                             width_in_output, height_in_output);
-
-                copy_pixels_to_shm_buffer(buffer, per_output_buffer,
-                                          region_x_in_global - x, region_y_in_global - y,
-                                          width_in_output, height_in_output);
-            } else {
-                wl_shm_buffer_begin_access(buffer);
-                {
-                    void *data = wl_shm_buffer_get_data(buffer);
-                    wakefield->compositor->renderer->read_pixels(output,
-                                                                 buffer_format_pixman,
-                                                                 data,
-                                                                 x_in_output, y_in_output,
-                                                                 width, height);
+/**
+ * Adds the requests to the wakefield interfaces to the recording as text.
+ */
+static void
+record_request(void *data, enum wl_protocol_logger_type direction,
+               const struct wl_protocol_logger_message *message)
+{
+    struct wakefield *wakefield = data;
+
+    const char *class = wl_resource_get_class(message->resource);
+    if (direction != WL_PROTOCOL_LOGGER_REQUEST || wakefield->recorder.file == NULL
+        || strncmp(class, "wakefield", strlen("wakefield")) != 0)
+        return;
+
+    char text[1024];
+    size_t length = 0;
+    append_text(text, sizeof(text), &length, "%s@%u.%s(",
+                class, wl_resource_get_id(message->resource), message->message->name);
+
+    int i = 0;
+    for (const char *s = message->message->signature; *s && i < message->arguments_count; s++) {
+        if (*s == '?' || (*s >= '0' && *s <= '9'))
+            continue; // nullability and "since" version
+
+        const union wl_argument *arg = &message->arguments[i];
+        const char *separator = i++ > 0 ? ", " : "";
+        struct wl_resource *object = (struct wl_resource *)arg->o;
+        switch (*s) {
+            case 'i':
+                append_text(text, sizeof(text), &length, "%s%d", separator, arg->i);
+                break;
+            case 'u':
+                append_text(text, sizeof(text), &length, "%s%u", separator, arg->u);
+                break;
+            case 'f':
+                append_text(text, sizeof(text), &length, "%s%f", separator, wl_fixed_to_double(arg->f));
+                break;
+            case 's':
+                append_text(text, sizeof(text), &length, "%s\"%s\"", separator, arg->s ? arg->s : "");
+                break;
+            case 'o':
+                if (object) {
+                    append_text(text, sizeof(text), &length, "%s%s@%u", separator,
+                                wl_resource_get_class(object), wl_resource_get_id(object));
+                } else {
+                    append_text(text, sizeof(text), &length, "%snil", separator);
                 }
-                wl_shm_buffer_end_access(buffer);
-                // This is the case of the entire region located on just one output,
-                // and we have just processed it, so can exit immediately.
                 break;
-            }
+            case 'n':
+                append_text(text, sizeof(text), &length, "%snew id %u", separator, arg->n);
+                break;
+            case 'a':
+                append_text(text, sizeof(text), &length, "%sarray[%zu]", separator, arg->a->size);
+                break;
+            case 'h':
+                append_text(text, sizeof(text), &length, "%sfd %d", separator, arg->h);
+                break;
         }
-
-        pixman_region32_fini(&region_in_output);
-        pixman_region32_fini(&region_global);
     }
+    append_text(text, sizeof(text), &length, ")");
+
+    wakefield_record_write_request(&wakefield->recorder, record_time(wakefield), text);
+    record_check_failed(wakefield);
+}
+
+static void
+output_frame_notify(struct wl_listener *listener, void *data)
+{
+    struct wakefield_output *wo = container_of(listener, struct wakefield_output, frame_listener);
 
-    if (per_output_buffer) {
-        free(per_output_buffer);
+    // The output has just been repainted, so what we've read from it before is stale now.
+    wo->snapshot.valid = false;
+
+    pixman_region32_t *damage = data;
+    damage_captures(wo->wakefield, damage);
+    pending_captures_output_done(wo->wakefield, wo->output);
+    syncs_output_done(wo->wakefield, wo->output);
+    check_conditions(wo->wakefield, damage);
+    damage_screencasts(wo->wakefield, damage);
+    check_surface_watches(wo->wakefield);
+    record_frame(wo, damage);
+}
+
+static void
+wakefield_output_create(struct wakefield *wakefield, struct weston_output *output)
+{
+    struct wakefield_output *wo = zalloc(sizeof(struct wakefield_output));
+    if (wo == NULL) {
+        weston_log_scope_printf(wakefield->log,
+                                "WAKEFIELD: failed to allocate state for output '%s'\n", output->name);
+        return;
     }
 
-    wakefield_send_capture_ready(resource, buffer_resource, WAKEFIELD_ERROR_NO_ERROR);
+    wo->wakefield = wakefield;
+    wo->output    = output;
+    wo->frame_listener.notify = output_frame_notify;
+    wl_signal_add(&output->frame_signal, &wo->frame_listener);
+    wl_list_insert(&wakefield->output_list, &wo->link);
+
+    weston_log_scope_printf(wakefield->log, "WAKEFIELD: tracking output '%s'\n", output->name);
 }
 
-static const struct wakefield_interface wakefield_implementation = {
-        .get_surface_location = wakefield_get_surface_location,
-        .move_surface = wakefield_move_surface,
-        .get_pixel_color = wakefield_get_pixel_color,
-        .capture_create = wakefield_capture_create
-};
+static void
+wakefield_output_destroy(struct wakefield_output *wo)
+{
+    wl_list_remove(&wo->frame_listener.link);
+    wl_list_remove(&wo->link);
+    free(wo->snapshot.pixels);
+    free(wo);
+}
 
 static void
-wakefield_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+output_created_notify(struct wl_listener *listener, void *data)
 {
-    struct wakefield *wakefield = data;
+    struct wakefield *wakefield = container_of(listener, struct wakefield, output_created_listener);
+    struct weston_output *output = data;
 
-    struct wl_resource *resource = wl_resource_create(client, &wakefield_interface, 1, id);
-    if (resource) {
-        wl_resource_set_implementation(resource, &wakefield_implementation, wakefield, NULL);
+    wakefield_output_create(wakefield, output);
+    damage_captures(wakefield, NULL);
+}
+
+static void
+output_destroyed_notify(struct wl_listener *listener, void *data)
+{
+    struct wakefield *wakefield = container_of(listener, struct wakefield, output_destroyed_listener);
+    struct weston_output *output = data;
+
+    struct wakefield_output *wo = get_wakefield_output(wakefield, output);
+    if (wo) {
+        weston_log_scope_printf(wakefield->log, "WAKEFIELD: output '%s' gone\n", output->name);
+        record_output_removed(wo);
+        wakefield_output_destroy(wo);
     }
 
-    weston_log_scope_printf(wakefield->log, "WAKEFIELD: bind\n");
+    damage_captures(wakefield, NULL);
+    pending_captures_output_done(wakefield, output);
+    syncs_output_done(wakefield, output);
+}
+
+static void
+output_moved_notify(struct wl_listener *listener, void *data)
+{
+    struct wakefield *wakefield = container_of(listener, struct wakefield, output_moved_listener);
+
+    damage_captures(wakefield, NULL);
 }
 
 static void
@@ -486,11 +4169,93 @@ wakefield_destroy(struct wl_listener *listener, void *data)
     weston_log_scope_printf(wakefield->log, "WAKEFIELD: destroy\n");
 
     wl_list_remove(&wakefield->destroy_listener.link);
+    wl_list_remove(&wakefield->output_created_listener.link);
+    wl_list_remove(&wakefield->output_destroyed_listener.link);
+    wl_list_remove(&wakefield->output_moved_listener.link);
+
+    struct wakefield_output *wo, *tmp;
+    wl_list_for_each_safe(wo, tmp, &wakefield->output_list, link) {
+        wakefield_output_destroy(wo);
+    }
 
+    record_stop(wakefield);
+    wakefield_encoder_fini(&wakefield->encoder);
+    struct wakefield_compressed_capture *capture, *capture_tmp;
+    wl_list_for_each_safe(capture, capture_tmp, &wakefield->compressed_capture_list, link) {
+        wl_list_remove(&capture->link);
+        free(capture);
+    }
+
+    wakefield_workers_fini(&wakefield->workers);
+    wakefield_scratch_fini(&wakefield->scratch);
     weston_log_scope_destroy(wakefield->log);
     free(wakefield);
 }
 
+/**
+ * Checks if the given command line argument is the option with the given name.
+ *
+ * @param value (OUT) the part after '=' or NULL if the argument has no value
+ */
+static bool
+match_option(const char *arg, const char *name, const char **value)
+{
+    const size_t name_length = strlen(name);
+    if (strncmp(arg, name, name_length) != 0)
+        return false;
+
+    if (arg[name_length] == '\0') {
+        *value = NULL;
+        return true;
+    }
+
+    if (arg[name_length] == '=') {
+        *value = &arg[name_length + 1];
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Picks up the plugin's own options (--wakefield-*) from weston's command line
+ * and removes them from there so that weston doesn't complain about unknown options.
+ */
+static void
+parse_options(struct wakefield *wakefield, int *argc, char *argv[])
+{
+    int i = 1;
+    while (i < *argc) {
+        const char *value;
+        if (match_option(argv[i], "--wakefield-snapshot-cache", &value)) {
+            wakefield->snapshot_cache = true;
+        } else if (match_option(argv[i], "--wakefield-scratch-high-water-mark", &value) && value) {
+            wakefield->scratch_high_water_mark = strtoul(value, NULL, 10) << 20;
+        } else if (match_option(argv[i], "--wakefield-threads", &value) && value) {
+            wakefield->threads = MAX(1, MIN(atoi(value), WAKEFIELD_MAX_THREADS));
+        } else if (match_option(argv[i], "--wakefield-pixman-direct", &value)) {
+            wakefield->pixman_direct = true;
+        } else if (match_option(argv[i], "--wakefield-repaint-step", &value)) {
+            wakefield->repaint_step = true;
+        } else if (match_option(argv[i], "--wakefield-scene-sampling", &value)) {
+            wakefield->scene_sampling = true;
+        } else if (match_option(argv[i], "--wakefield-record", &value) && value) {
+            wakefield->record_path = value;
+        } else if (match_option(argv[i], "--wakefield-record-outputs", &value) && value) {
+            wakefield->record_outputs = value;
+        } else if (match_option(argv[i], "--wakefield-record-keyframe-interval", &value) && value) {
+            wakefield->record_keyframe_interval = MAX(1, atoi(value));
+        } else {
+            i++;
+            continue;
+        }
+
+        weston_log("wakefield: option %s\n", argv[i]);
+        memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(argv[0]));
+        (*argc)--;
+    }
+}
+
 WL_EXPORT int
 wet_module_init(struct weston_compositor *wc, int *argc, char *argv[])
 {
@@ -506,15 +4271,95 @@ wet_module_init(struct weston_compositor *wc, int *argc, char *argv[])
 
 
     wakefield->compositor = wc;
+    wl_list_init(&wakefield->output_list);
+    wl_list_init(&wakefield->pending_capture_list);
+    wl_list_init(&wakefield->capture_list);
+    wl_list_init(&wakefield->condition_list);
+    wl_list_init(&wakefield->screencast_list);
+    wl_list_init(&wakefield->compressed_capture_list);
+    wl_list_init(&wakefield->surface_watch_list);
+    wl_list_init(&wakefield->sync_list);
+    wakefield->scratch_high_water_mark = (size_t)WAKEFIELD_SCRATCH_HIGH_WATER_MARK_MB << 20;
+    wakefield->threads = 1;
+    wakefield->record_keyframe_interval = WAKEFIELD_RECORD_KEYFRAME_INTERVAL;
+    parse_options(wakefield, argc, argv);
     // Log scope; add this to weston option list to subscribe: `--logger-scopes=wakefield`
     // See https://wayland.pages.freedesktop.org/weston/toc/libweston/log.html for more info.
     wakefield->log = weston_compositor_add_log_scope(wc, "wakefield",
                                                      "wakefield plugin own actions",
                                                      NULL, NULL, NULL);
+    weston_log("wakefield: pixel conversion uses %s code\n", wakefield_convert_isa_name());
 
-    if (wl_global_create(wc->wl_display, &wakefield_interface,
-                         1, wakefield, wakefield_bind) == NULL) {
+    // Only the GL renderer flips captures vertically; its output state is nothing like pixman's.
+    if (wakefield->pixman_direct && (wc->capabilities & WESTON_CAP_CAPTURE_YFLIP)) {
+        weston_log("wakefield: --wakefield-pixman-direct needs the pixman renderer (--use-pixman), ignored\n");
+        wakefield->pixman_direct = false;
+    }
+#if WESTON_VERSION_MAJOR != 9
+    if (wakefield->pixman_direct) {
+        weston_log("wakefield: --wakefield-pixman-direct needs weston 9, ignored\n");
+        wakefield->pixman_direct = false;
+    }
+    if (wakefield->repaint_step) {
+        weston_log("wakefield: --wakefield-repaint-step needs weston 9, ignored\n");
+        wakefield->repaint_step = false;
+    }
+#endif
+
+    if (!wakefield_scratch_init(&wakefield->scratch, wl_display_get_event_loop(wc->wl_display),
+                                wakefield->log, wakefield->scratch_high_water_mark)) {
+        wl_list_remove(&wakefield->destroy_listener.link);
+        weston_log_scope_destroy(wakefield->log);
+        free(wakefield);
+        return -1;
+    }
+
+    if (!wakefield_workers_init(&wakefield->workers, wakefield->threads - 1)) {
+        weston_log("wakefield: failed to start %d thread(s)\n", wakefield->threads - 1);
+        wakefield_scratch_fini(&wakefield->scratch);
+        wl_list_remove(&wakefield->destroy_listener.link);
+        weston_log_scope_destroy(wakefield->log);
+        free(wakefield);
+        return -1;
+    }
+
+    if (!wakefield_encoder_init(&wakefield->encoder, wl_display_get_event_loop(wc->wl_display),
+                                compressed_capture_done, wakefield)) {
+        weston_log("wakefield: failed to start the encoder thread\n");
+        wakefield_workers_fini(&wakefield->workers);
+        wakefield_scratch_fini(&wakefield->scratch);
         wl_list_remove(&wakefield->destroy_listener.link);
+        weston_log_scope_destroy(wakefield->log);
+        free(wakefield);
+        return -1;
+    }
+
+    if (wakefield->record_path) {
+        if (wakefield_record_open(&wakefield->recorder, wakefield->record_path)) {
+            weston_compositor_read_presentation_clock(wc, &wakefield->record_start);
+            wakefield->request_logger = wl_display_add_protocol_logger(wc->wl_display, record_request, wakefield);
+            weston_log("wakefield: recording the session into %s\n", wakefield->record_path);
+        } else {
+            weston_log("wakefield: failed to open %s for recording: %s\n",
+                       wakefield->record_path, strerror(errno));
+        }
+    }
+
+    struct weston_output *output;
+    wl_list_for_each(output, &wc->output_list, link) {
+        wakefield_output_create(wakefield, output);
+    }
+
+    wakefield->output_created_listener.notify = output_created_notify;
+    wl_signal_add(&wc->output_created_signal, &wakefield->output_created_listener);
+    wakefield->output_destroyed_listener.notify = output_destroyed_notify;
+    wl_signal_add(&wc->output_destroyed_signal, &wakefield->output_destroyed_listener);
+    wakefield->output_moved_listener.notify = output_moved_notify;
+    wl_signal_add(&wc->output_moved_signal, &wakefield->output_moved_listener);
+
+    if (wl_global_create(wc->wl_display, &wakefield_interface,
+                         WAKEFIELD_VERSION, wakefield, wakefield_bind) == NULL) {
+        wakefield_destroy(&wakefield->destroy_listener, NULL);
         return -1;
     }
 
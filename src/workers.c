@@ -0,0 +1,123 @@
+#include <stdlib.h>
+
+#include "workers.h"
+
+/**
+ * Takes and runs jobs of the current batch until there are none left.
+ * Must be called with the lock held; returns with the lock held.
+ */
+static void
+run_jobs(struct wakefield_workers *workers)
+{
+    while (workers->next_job < workers->n_jobs) {
+        const int index = workers->next_job++;
+        pthread_mutex_unlock(&workers->lock);
+
+        workers->func(workers->data, index);
+
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->pending_jobs == 0) {
+            pthread_cond_signal(&workers->done_cond);
+        }
+    }
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct wakefield_workers *workers = arg;
+
+    pthread_mutex_lock(&workers->lock);
+    uint32_t batch = workers->batch;
+    while (true) {
+        while (!workers->quit && workers->batch == batch) {
+            pthread_cond_wait(&workers->work_cond, &workers->lock);
+        }
+        if (workers->quit)
+            break;
+
+        batch = workers->batch;
+        run_jobs(workers);
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    return NULL;
+}
+
+bool
+wakefield_workers_init(struct wakefield_workers *workers, int n_threads)
+{
+    workers->threads      = NULL;
+    workers->n_threads    = 0;
+    workers->func         = NULL;
+    workers->data         = NULL;
+    workers->n_jobs       = 0;
+    workers->next_job     = 0;
+    workers->pending_jobs = 0;
+    workers->batch        = 0;
+    workers->quit         = false;
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+
+    if (n_threads <= 0)
+        return true;
+
+    workers->threads = calloc(n_threads, sizeof(pthread_t));
+    if (workers->threads == NULL)
+        return false;
+
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&workers->threads[i], NULL, worker_main, workers) != 0) {
+            wakefield_workers_fini(workers);
+            return false;
+        }
+        workers->n_threads++;
+    }
+
+    return true;
+}
+
+void
+wakefield_workers_fini(struct wakefield_workers *workers)
+{
+    pthread_mutex_lock(&workers->lock);
+    workers->quit = true;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (int i = 0; i < workers->n_threads; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+    free(workers->threads);
+    workers->threads   = NULL;
+    workers->n_threads = 0;
+
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_mutex_destroy(&workers->lock);
+}
+
+void
+wakefield_workers_run(struct wakefield_workers *workers, wakefield_job_func_t func, void *data, int n_jobs)
+{
+    if (n_jobs <= 0)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->func         = func;
+    workers->data         = data;
+    workers->n_jobs       = n_jobs;
+    workers->next_job     = 0;
+    workers->pending_jobs = n_jobs;
+    workers->batch++;
+    if (workers->n_threads > 0 && n_jobs > 1) {
+        pthread_cond_broadcast(&workers->work_cond);
+    }
+
+    run_jobs(workers);
+    while (workers->pending_jobs > 0) {
+        pthread_cond_wait(&workers->done_cond, &workers->lock);
+    }
+    pthread_mutex_unlock(&workers->lock);
+}
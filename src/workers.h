@@ -0,0 +1,54 @@
+#ifndef WAKEFIELD_WORKERS_H
+#define WAKEFIELD_WORKERS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A job is a function called with the shared data and the index of the job.
+ */
+typedef void (*wakefield_job_func_t)(void *data, int index);
+
+/**
+ * A fixed set of threads that help the compositor thread run a batch of independent jobs.
+ * wakefield_workers_run() returns only after all the jobs of the batch are done, so
+ * the jobs may use anything the compositor thread owns as long as they don't touch
+ * the same memory or call into anything that isn't thread-safe.
+ */
+struct wakefield_workers {
+    pthread_t       *threads;
+    int              n_threads;    // not counting the compositor thread
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cond;    // signalled when a new batch starts
+    pthread_cond_t   done_cond;    // signalled when the last job of the batch is done
+
+    wakefield_job_func_t func;
+    void            *data;
+    int              n_jobs;
+    int              next_job;     // the index of the next job to be taken
+    int              pending_jobs; // not done yet
+    uint32_t         batch;        // incremented for every batch
+    bool             quit;
+};
+
+/**
+ * Starts the given number of threads; with 0 threads, all jobs run on the calling thread.
+ *
+ * @return false if the threads could not be started.
+ */
+bool
+wakefield_workers_init(struct wakefield_workers *workers, int n_threads);
+
+void
+wakefield_workers_fini(struct wakefield_workers *workers);
+
+/**
+ * Runs n_jobs jobs with the given function and data on the calling thread and the worker
+ * threads and returns when all of them are done.
+ */
+void
+wakefield_workers_run(struct wakefield_workers *workers, wakefield_job_func_t func, void *data, int n_jobs);
+
+#endif //WAKEFIELD_WORKERS_H